@@ -3,7 +3,12 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
 /* A block device. */
 struct block
@@ -17,10 +22,44 @@ struct block
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
 
+    /* Request queue, used only by devices without a remap
+       operation.  The I/O thread and bounce buffer are set up by
+       the first block_submit(). */
+    struct lock queue_lock;             /* Protects the queue members. */
+    struct condition queue_nonempty;    /* Signaled when QUEUE gains one. */
+    struct list queue;                  /* Submitted block_requests. */
+    struct list read_fifo;              /* Queued reads, oldest first. */
+    block_sector_t head;                /* Sector after last dispatched. */
+    bool io_started;                    /* I/O thread running? */
+    uint8_t *bounce;                    /* Buffer for merged requests. */
+
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    unsigned long long merge_cnt;       /* Requests merged into others. */
+  };
+
+/* Most sectors that merged requests may cover. */
+#define MERGE_MAX_SECTORS 64
+
+/* Ticks a read may wait before the elevator serves it out of
+   order. */
+#define READ_DEADLINE (TIMER_FREQ / 2)
+
+/* An I/O scheduler, which orders the requests in a device's
+   queue.  Called with the device's queue_lock held. */
+struct io_scheduler
+  {
+    const char *name;
+    void (*add) (struct block *, struct block_request *);
+    struct block_request *(*next) (struct block *);
   };
 
+static const struct io_scheduler noop_scheduler;
+static const struct io_scheduler elevator_scheduler;
+
+/* The I/O scheduler in use for all devices. */
+static const struct io_scheduler *scheduler = &elevator_scheduler;
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
@@ -28,6 +67,8 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void start_io (struct block *);
+static thread_func io_thread NO_RETURN;
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -120,9 +161,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, 1, buffer);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +172,433 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, 1, buffer);
+}
+
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that support it transfer the whole run with a
+   single command.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffer)
+{
+  struct block_request r;
+
+  if (cnt == 0)
+    return;
+  block_request_init (&r, false, sector, cnt, buffer, NULL, NULL);
+  block_submit (block, &r);
+  block_wait (&r);
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving all
+   of the data.  Drivers that support it transfer the whole run
+   with a single command.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      size_t cnt, const void *buffer)
+{
+  struct block_request r;
+
+  if (cnt == 0)
+    return;
+  block_request_init (&r, true, sector, cnt, (void *) buffer, NULL, NULL);
+  block_submit (block, &r);
+  block_wait (&r);
+}
+
+/* Initializes R as a request to transfer CNT sectors starting
+   at SECTOR between a block device and BUFFER, writing to the
+   device if WRITE is true and reading from it otherwise.
+
+   If DONE is null, completion is awaited with block_wait().
+   Otherwise, DONE is called with R, from the device's I/O
+   thread, when the transfer completes, and R belongs to DONE
+   from then on; AUX is stored in R for its use.  DONE should not
+   sleep for long, since the device's next request waits for
+   it. */
+void
+block_request_init (struct block_request *r, bool write,
+                    block_sector_t sector, size_t cnt, void *buffer,
+                    block_done_func *done, void *aux)
+{
+  ASSERT (r != NULL);
+  ASSERT (cnt > 0);
+
+  r->write = write;
+  r->sector = sector;
+  r->cnt = cnt;
+  r->buffer = buffer;
+  r->done = done;
+  r->aux = aux;
+  sema_init (&r->complete, 0);
+}
+
+/* Queues request R on BLOCK and returns without waiting for it.
+   A request for a device with a remap operation, such as a
+   partition, is translated and queued on the underlying device
+   instead, so R's SECTOR may change.  Panics if R runs past the
+   end of BLOCK. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  r->block = block;
+  for (;;)
+    {
+      check_sector (block, r->sector);
+      check_sector (block, r->sector + r->cnt - 1);
+      ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+      if (block->ops->remap == NULL)
+        break;
+      block = block->ops->remap (block->aux, &r->sector);
+    }
+
+  lock_acquire (&block->queue_lock);
+  if (!block->io_started)
+    start_io (block);
+  r->deadline = timer_ticks () + READ_DEADLINE;
+  scheduler->add (block, r);
+  cond_signal (&block->queue_nonempty, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Starts the I/O thread for BLOCK and allocates its bounce
+   buffer.  Must be called with BLOCK's queue_lock held. */
+static void
+start_io (struct block *block)
+{
+  /* Without a bounce buffer, requests are not merged. */
+  block->bounce = palloc_get_multiple (0, MERGE_MAX_SECTORS
+                                       * BLOCK_SECTOR_SIZE / PGSIZE);
+  if (thread_create (block->name, PRI_MAX, io_thread, block) == TID_ERROR)
+    PANIC ("Failed to start I/O thread for block device %s", block->name);
+  block->io_started = true;
+}
+
+/* Waits for request R, which must have been submitted with a
+   null DONE function, to complete.  At most one thread may wait
+   for a given request. */
+void
+block_wait (struct block_request *r)
+{
+  ASSERT (r->done == NULL);
+  sema_down (&r->complete);
+}
+
+/* Calls BLOCK's driver to transfer CNT sectors starting at
+   SECTOR between the device and BUFFER, writing if WRITE is
+   true. */
+static void
+transfer (struct block *block, bool write, block_sector_t sector,
+          size_t cnt, uint8_t *buffer)
+{
+  const struct block_operations *ops = block->ops;
+  size_t i;
+
+  if (!write)
+    {
+      if (ops->read_multiple != NULL)
+        ops->read_multiple (block->aux, sector, cnt, buffer);
+      else
+        for (i = 0; i < cnt; i++)
+          ops->read (block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+    }
+  else
+    {
+      if (ops->write_multiple != NULL)
+        ops->write_multiple (block->aux, sector, cnt, buffer);
+      else
+        for (i = 0; i < cnt; i++)
+          ops->write (block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+    }
+}
+
+/* Removes request R from its device's queue.  Must be called
+   with the device's queue_lock held. */
+static void
+dequeue (struct block_request *r)
+{
+  list_remove (&r->elem);
+  if (!r->write && scheduler == &elevator_scheduler)
+    list_remove (&r->fifo_elem);
+}
+
+/* Returns true if request B continues request A: same direction,
+   and B's sectors follow A's. */
+static bool
+adjacent (const struct block_request *a, const struct block_request *b)
+{
+  return a->write == b->write && a->sector + a->cnt == b->sector;
+}
+
+/* Removes request R, chosen by the scheduler, from BLOCK's queue,
+   along with the queued requests that it can be merged with, and
+   appends them all to BATCH in sector order.  Neighbors of R in
+   the queue are merged in front of R while they end where the
+   batch starts and behind it while they start where the batch
+   ends, up to MERGE_MAX_SECTORS in all.  Moves BLOCK's head past
+   the batch.  Returns the number of sectors in BATCH.  Must be
+   called with BLOCK's queue_lock held. */
+static size_t
+take_batch (struct block *block, struct block_request *r, struct list *batch)
+{
+  struct block_request *first = r, *last = r;
+  size_t cnt = r->cnt;
+
+  if (block->bounce != NULL)
+    {
+      for (;;)
+        {
+          struct list_elem *e = list_prev (&first->elem);
+          struct block_request *p;
+
+          if (e == list_head (&block->queue))
+            break;
+          p = list_entry (e, struct block_request, elem);
+          if (!adjacent (p, first) || cnt + p->cnt > MERGE_MAX_SECTORS)
+            break;
+          first = p;
+          cnt += p->cnt;
+        }
+      for (;;)
+        {
+          struct list_elem *e = list_next (&last->elem);
+          struct block_request *n;
+
+          if (e == list_end (&block->queue))
+            break;
+          n = list_entry (e, struct block_request, elem);
+          if (!adjacent (last, n) || cnt + n->cnt > MERGE_MAX_SECTORS)
+            break;
+          last = n;
+          cnt += n->cnt;
+        }
+    }
+
+  for (;;)
+    {
+      struct block_request *next
+        = (first != last
+           ? list_entry (list_next (&first->elem), struct block_request, elem)
+           : NULL);
+
+      dequeue (first);
+      if (first != r)
+        first->block->merge_cnt++;
+      list_push_back (batch, &first->elem);
+      if (next == NULL)
+        break;
+      first = next;
+    }
+  block->head = last->sector + last->cnt;
+  return cnt;
+}
+
+/* Carries out the CNT-sector BATCH of requests on BLOCK with one
+   call into the driver.  A batch of more than one request goes
+   through BLOCK's bounce buffer, unless the requests' buffers
+   happen to be contiguous. */
+static void
+dispatch (struct block *block, struct list *batch, size_t cnt)
+{
+  struct block_request *first = list_entry (list_front (batch),
+                                            struct block_request, elem);
+  uint8_t *buffer = first->buffer;
+  struct list_elem *e;
+  uint8_t *p;
+
+  /* Use the requests' own memory if it is contiguous. */
+  p = first->buffer;
+  for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->buffer != p)
+        {
+          buffer = block->bounce;
+          break;
+        }
+      p += r->cnt * BLOCK_SECTOR_SIZE;
+    }
+
+  if (buffer == block->bounce && first->write)
+    for (p = buffer, e = list_begin (batch); e != list_end (batch);
+         e = list_next (e))
+      {
+        struct block_request *r = list_entry (e, struct block_request, elem);
+        memcpy (p, r->buffer, r->cnt * BLOCK_SECTOR_SIZE);
+        p += r->cnt * BLOCK_SECTOR_SIZE;
+      }
+
+  transfer (block, first->write, first->sector, cnt, buffer);
+
+  if (buffer == block->bounce && !first->write)
+    for (p = buffer, e = list_begin (batch); e != list_end (batch);
+         e = list_next (e))
+      {
+        struct block_request *r = list_entry (e, struct block_request, elem);
+        memcpy (r->buffer, p, r->cnt * BLOCK_SECTOR_SIZE);
+        p += r->cnt * BLOCK_SECTOR_SIZE;
+      }
+}
+
+/* Adds request R's sectors to BLOCK's statistics.  Called only
+   from the I/O thread that carried out R, so that each device's
+   counters have a single writer. */
+static void
+count (struct block *block, const struct block_request *r)
+{
+  if (r->write)
+    block->write_cnt += r->cnt;
+  else
+    block->read_cnt += r->cnt;
+}
+
+/* I/O thread for block device BLOCK_.  Takes the request chosen
+   by the I/O scheduler, together with any it can be merged with,
+   carries them out, and completes each one. */
+static void
+io_thread (void *block_)
+{
+  struct block *block = block_;
+
+  for (;;)
+    {
+      struct list batch;
+      size_t cnt;
+
+      list_init (&batch);
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_nonempty, &block->queue_lock);
+      cnt = take_batch (block, scheduler->next (block), &batch);
+      lock_release (&block->queue_lock);
+
+      dispatch (block, &batch, cnt);
+
+      while (!list_empty (&batch))
+        {
+          struct block_request *r = list_entry (list_pop_front (&batch),
+                                                struct block_request, elem);
+          count (block, r);
+          if (r->block != block)
+            count (r->block, r);
+          if (r->done != NULL)
+            r->done (r);
+          else
+            sema_up (&r->complete);
+        }
+    }
+}
+
+/* No-op I/O scheduler: requests go to the driver in the order
+   they were submitted, except that adjacent ones are merged. */
+
+static void
+noop_add (struct block *block, struct block_request *r)
+{
+  list_push_back (&block->queue, &r->elem);
+}
+
+static struct block_request *
+noop_next (struct block *block)
+{
+  return list_entry (list_front (&block->queue), struct block_request, elem);
+}
+
+static const struct io_scheduler noop_scheduler =
+  {
+    "noop",
+    noop_add,
+    noop_next,
+  };
+
+/* Elevator I/O scheduler.  The queue is kept sorted by sector and
+   served in C-LOOK order: upward from the sector the disk head
+   last stopped at, then back to the lowest queued sector.  A read
+   that has waited READ_DEADLINE ticks is served next regardless,
+   so a stream of requests near the head cannot starve it. */
+
+/* Returns true if request A's sector is less than B's. */
+static bool
+sector_less (const struct list_elem *a_, const struct list_elem *b_,
+             void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+
+  return a->sector < b->sector;
+}
+
+static void
+elevator_add (struct block *block, struct block_request *r)
+{
+  list_insert_ordered (&block->queue, &r->elem, sector_less, NULL);
+  if (!r->write)
+    list_push_back (&block->read_fifo, &r->fifo_elem);
+}
+
+static struct block_request *
+elevator_next (struct block *block)
+{
+  struct list_elem *e;
+
+  /* Serve an expired read first. */
+  if (!list_empty (&block->read_fifo))
+    {
+      struct block_request *r = list_entry (list_front (&block->read_fifo),
+                                            struct block_request, fifo_elem);
+      if (timer_ticks () >= r->deadline)
+        return r;
+    }
+
+  /* Otherwise continue the sweep upward, wrapping to the start. */
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->sector >= block->head)
+        return r;
+    }
+  return list_entry (list_front (&block->queue), struct block_request, elem);
+}
+
+static const struct io_scheduler elevator_scheduler =
+  {
+    "elevator",
+    elevator_add,
+    elevator_next,
+  };
+
+/* Selects the I/O scheduler named NAME, "noop" or "elevator", for
+   all block devices.  Returns true if successful, false if there
+   is no scheduler by that name.  Must be called before any block
+   device is registered. */
+bool
+block_set_scheduler (const char *name)
+{
+  static const struct io_scheduler *schedulers[] =
+    {
+      &noop_scheduler,
+      &elevator_scheduler,
+    };
+  size_t i;
+
+  ASSERT (list_empty (&all_blocks));
+
+  for (i = 0; i < sizeof schedulers / sizeof *schedulers; i++)
+    if (!strcmp (name, schedulers[i]->name))
+      {
+        scheduler = schedulers[i];
+        return true;
+      }
+  return false;
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,6 +622,15 @@ block_type (struct block *block)
   return block->type;
 }
 
+/* Returns the AUX that BLOCK was registered with if its driver
+   operations are OPS, otherwise a null pointer.  Lets a driver
+   recognize its own devices. */
+void *
+block_driver_data (struct block *block, const struct block_operations *ops)
+{
+  return block->ops == ops ? block->aux : NULL;
+}
+
 /* Prints statistics for each block device used for a Pintos role. */
 void
 block_print_stats (void)
@@ -171,11 +642,12 @@ block_print_stats (void)
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
-          printf ("%s (%s): %llu reads, %llu writes\n",
+          printf ("%s (%s): %llu reads, %llu writes, %llu merged\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  block->read_cnt, block->write_cnt, block->merge_cnt);
         }
     }
+  ide_print_stats ();
 }
 
 /* Registers a new block device with the given NAME.  If
@@ -200,6 +672,14 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->merge_cnt = 0;
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_nonempty);
+  list_init (&block->queue);
+  list_init (&block->read_fifo);
+  block->head = 0;
+  block->io_started = false;
+  block->bounce = NULL;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -1,8 +1,11 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -21,6 +24,7 @@ typedef uint32_t block_sector_t;
 /* Higher-level interface for file systems, etc. */
 
 struct block;
+struct block_operations;
 
 /* Type of a block device. */
 enum block_type
@@ -53,18 +57,77 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt,
+                          void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
+void *block_driver_data (struct block *, const struct block_operations *);
+
+/* Asynchronous requests.
+
+   A request is submitted with block_submit(), which returns at
+   once.  The device's I/O thread carries requests out in the
+   order chosen by the I/O scheduler, merging requests for
+   adjacent sectors into one driver call.  When a request is
+   done, the thread calls its DONE function, or wakes its
+   block_wait() if it has none.  The request and its buffer must
+   stay valid until then.  The synchronous functions above just
+   submit a request and wait for it. */
+struct block_request;
+typedef void block_done_func (struct block_request *);
+
+struct block_request
+  {
+    struct list_elem elem;      /* Element in device's queue. */
+    struct list_elem fifo_elem; /* Element in device's read FIFO. */
+    int64_t deadline;           /* Tick by which a read should start. */
+    struct block *block;        /* Device R was submitted to. */
+    bool write;                 /* Write if true, read if false. */
+    block_sector_t sector;      /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    void *buffer;               /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    block_done_func *done;      /* Called on completion, if non-null. */
+    void *aux;                  /* For use by DONE. */
+    struct semaphore complete;  /* Up'd on completion if no DONE. */
+  };
+
+void block_request_init (struct block_request *, bool write,
+                         block_sector_t, size_t cnt, void *buffer,
+                         block_done_func *, void *aux);
+void block_submit (struct block *, struct block_request *);
+void block_wait (struct block_request *);
+
+/* I/O scheduling. */
+bool block_set_scheduler (const char *name);
 
 /* Statistics. */
 void block_print_stats (void);
 
-/* Lower-level interface to block device drivers. */
+/* Lower-level interface to block device drivers.
+
+   The block layer calls the transfer functions only from a
+   device's I/O thread, one request at a time. */
 
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional.  Transfer a run of consecutive sectors at once.
+       If null, the run is transferred one sector at a time. */
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+
+    /* Optional.  For a device that is a range of sectors on
+       another one, such as a partition: returns the other device
+       and translates *SECTOR to it.  Requests are then queued on
+       the other device, and the transfer functions above are
+       never called. */
+    struct block *(*remap) (void *aux, block_sector_t *sector);
   };
 
 struct block *block_register (const char *name, enum block_type,
@@ -5,13 +5,18 @@
 #include <stdio.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].  If the
+   controller is a PCI bus-master IDE controller, such as the
+   Intel PIIX that QEMU emulates, sector data is moved by DMA;
+   otherwise it is moved by PIO. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -30,10 +35,28 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE registers, present if the channel's bm_base is
+   nonzero.  See the Intel PIIX datasheet, "Bus Master IDE
+   Function". */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
+
+/* Bus Master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus Master Status Register bits.  The last two are cleared by
+   writing 1s to them. */
+#define BM_STA_ACTIVE 0x01      /* Transfer in progress. */
+#define BM_STA_ERROR 0x02       /* Transfer failed. */
+#define BM_STA_INTR 0x04        /* Device interrupted. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +72,12 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Largest sector count that fits in one READ or WRITE SECTOR
+   command, which the sector count register encodes as 0. */
+#define MAX_SECTORS_PER_CMD 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +86,27 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    bool dma;                   /* Can transfer by DMA? */
+  };
+
+/* A physical region descriptor, one entry in the table that
+   tells the bus master where to move data.  A region may not
+   cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address of region. */
+    uint16_t size;              /* Bytes in region, 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last entry. */
   };
 
+/* PRD flags. */
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* Entries in a channel's PRD table.  A transfer of
+   MAX_SECTORS_PER_CMD sectors, 128 kB, touches at most three
+   64 kB regions. */
+#define PRD_CNT 16
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -66,6 +114,8 @@ struct channel
     char name[8];               /* Name, e.g. "ide0". */
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
+    uint16_t bm_base;           /* Bus master I/O port, 0 if none. */
+    struct prd *prdt;           /* PRD table for bus master. */
 
     struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
@@ -73,22 +123,44 @@ struct channel
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
     struct ata_disk devices[2];     /* The devices on this channel. */
+
+    /* Statistics, updated with the lock held. */
+    unsigned long long cmd_cnt;     /* Read and write commands issued. */
+    unsigned long long sector_cnt;  /* Sectors transferred. */
+    int64_t busy_ticks;             /* Timer ticks spent holding LOCK. */
+    int64_t busy_start;             /* When LOCK was last acquired. */
   };
 
 /* We support the two "legacy" ATA channels found in a standard PC. */
 #define CHANNEL_CNT 2
 static struct channel channels[CHANNEL_CNT];
 
+/* Number of channels with a command in progress, and for how
+   long at least one has been busy, to measure how much the
+   channels' busy periods overlap.  Accessed with interrupts
+   off. */
+static int busy_channel_cnt;
+static int64_t any_busy_start;
+static int64_t any_busy_ticks;
+
+/* PRD tables, one per channel.  A table may not cross a 64 kB
+   boundary, which aligning each to its own size ensures. */
+static struct prd prd_tables[CHANNEL_CNT][PRD_CNT]
+  __attribute__ ((aligned (PRD_CNT * 8)));
+
 static struct block_operations ide_operations;
 
+static void find_bus_master (void);
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
-static void issue_pio_command (struct channel *, uint8_t command);
+static void select_sectors (struct ata_disk *, block_sector_t, size_t cnt);
+static void issue_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          void *, bool read);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -123,6 +195,10 @@ ide_init (void)
         default:
           NOT_REACHED ();
         }
+      c->bm_base = 0;
+      c->prdt = prd_tables[chan_no];
+      c->cmd_cnt = c->sector_cnt = 0;
+      c->busy_ticks = c->busy_start = 0;
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
@@ -136,6 +212,7 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -153,6 +230,42 @@ ide_init (void)
         if (c->devices[dev_no].is_ata)
           identify_ata_device (&c->devices[dev_no]);
     }
+
+  /* Use DMA if the controller supports it. */
+  find_bus_master ();
+}
+
+/* Looks for a PCI IDE controller that can act as a bus master
+   for the legacy channels and, if there is one, enables bus
+   mastering and records each channel's bus master ports. */
+static void
+find_bus_master (void)
+{
+  struct pci_dev pci;
+  uint8_t prog_if;
+  uint32_t bar4;
+  size_t chan_no;
+
+  if (!pci_find_class (0x01, 0x01, &pci))
+    return;
+
+  /* Programming interface bit 7 means bus master capable.  Bits 0
+     and 2 mean a channel is in native mode, at ports other than
+     the legacy ones we drive. */
+  prog_if = pci_read_config (&pci, PCI_REG_CLASS) >> 8;
+  if (!(prog_if & 0x80) || (prog_if & 0x05))
+    return;
+
+  /* BAR4 holds the bus master registers, 8 ports per channel. */
+  bar4 = pci_read_config (&pci, PCI_REG_BAR0 + 4 * 4);
+  if (!(bar4 & 1) || (bar4 & 0xfffc) == 0)
+    return;
+  pci_write_config (&pci, PCI_REG_COMMAND,
+                    (pci_read_config (&pci, PCI_REG_COMMAND)
+                     | PCI_CMD_IO | PCI_CMD_MASTER));
+
+  for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
+    channels[chan_no].bm_base = (bar4 & 0xfffc) + chan_no * 8;
 }
 
 /* Disk detection and identification. */
@@ -272,7 +385,7 @@ identify_ata_device (struct ata_disk *d)
      indicating the device's response is ready, and read the data
      into our buffer. */
   select_device_wait (d);
-  issue_pio_command (c, CMD_IDENTIFY_DEVICE);
+  issue_command (c, CMD_IDENTIFY_DEVICE);
   sema_down (&c->completion_wait);
   if (!wait_while_busy (d))
     {
@@ -284,6 +397,7 @@ identify_ata_device (struct ata_disk *d)
   /* Calculate capacity.
      Read model name and serial number. */
   capacity = *(uint32_t *) &id[60 * 2];
+  d->dma = (*(uint16_t *) &id[49 * 2] & (1 << 8)) != 0;
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
   snprintf (extra_info, sizeof extra_info,
@@ -337,63 +451,221 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Reads CNT consecutive sectors, at most MAX_SECTORS_PER_CMD,
+   starting at SEC_NO from disk D into BUFFER by PIO.  The disk
+   interrupts once per sector as its data becomes ready.  Must be
+   called with D's channel locked. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          uint8_t *buffer)
+{
+  struct channel *c = d->channel;
+  size_t i;
+
+  select_sectors (d, sec_no, cnt);
+  issue_command (c, CMD_READ_SECTOR_RETRY);
+  for (i = 0; i < cnt; i++)
+    {
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no + i);
+      input_sector (c, buffer);
+      buffer += BLOCK_SECTOR_SIZE;
+    }
+}
+
+/* Writes CNT consecutive sectors, at most MAX_SECTORS_PER_CMD,
+   starting at SEC_NO to disk D from BUFFER by PIO.  Must be
+   called with D's channel locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const uint8_t *buffer)
+{
+  struct channel *c = d->channel;
+  size_t i;
+
+  select_sectors (d, sec_no, cnt);
+  issue_command (c, CMD_WRITE_SECTOR_RETRY);
+  for (i = 0; i < cnt; i++)
+    {
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no + i);
+      output_sector (c, buffer);
+      buffer += BLOCK_SECTOR_SIZE;
+      sema_down (&c->completion_wait);
+    }
+}
+
+/* Returns the number of the IDE channel that BLOCK, or the disk
+   that BLOCK is a partition of, is attached to, or -1 if BLOCK is
+   not on an IDE disk.  Each channel runs commands independently
+   of the other, so devices on different channels can be used
+   concurrently. */
+int
+ide_channel (struct block *block)
+{
+  struct block *base = partition_base (block);
+  struct ata_disk *d = block_driver_data (base != NULL ? base : block,
+                                          &ide_operations);
+  return d != NULL ? d->channel - channels : -1;
+}
+
+/* Prints statistics for each channel with a disk attached. */
+void
+ide_print_stats (void)
+{
+  int64_t busy_sum = 0;
+  int busy_channels = 0;
+  size_t chan_no;
+
+  for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
+    {
+      struct channel *c = &channels[chan_no];
+      if (c->devices[0].is_ata || c->devices[1].is_ata)
+        {
+          printf ("%s: %llu commands, %llu sectors, %"PRId64" ticks busy\n",
+                  c->name, c->cmd_cnt, c->sector_cnt, c->busy_ticks);
+          busy_sum += c->busy_ticks;
+          if (c->busy_ticks > 0)
+            busy_channels++;
+        }
+    }
+  if (busy_channels > 1)
+    printf ("ide: %"PRId64" ticks with more than one channel busy\n",
+            busy_sum - any_busy_ticks);
+}
+
+/* Acquires channel C for a transfer and starts timing how long
+   it stays busy. */
+static void
+channel_acquire (struct channel *c)
+{
+  enum intr_level old_level;
+
+  lock_acquire (&c->lock);
+  old_level = intr_disable ();
+  c->busy_start = timer_ticks ();
+  if (busy_channel_cnt++ == 0)
+    any_busy_start = c->busy_start;
+  intr_set_level (old_level);
+}
+
+/* Releases channel C, acquired with channel_acquire(), and adds
+   the time it was busy to the statistics. */
+static void
+channel_release (struct channel *c)
+{
+  enum intr_level old_level = intr_disable ();
+  int64_t now = timer_ticks ();
+
+  c->busy_ticks += now - c->busy_start;
+  if (--busy_channel_cnt == 0)
+    any_busy_ticks += now - any_busy_start;
+  intr_set_level (old_level);
+  lock_release (&c->lock);
+}
+
+/* Reads CNT consecutive sectors starting at SEC_NO from disk D
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Each run of up to MAX_SECTORS_PER_CMD sectors takes a
+   single command, by DMA if possible and otherwise by PIO.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  uint8_t *p = buffer;
+
+  channel_acquire (c);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_SECTORS_PER_CMD ? cnt : MAX_SECTORS_PER_CMD;
+
+      if (!dma_transfer (d, sec_no, n, p, true))
+        pio_read (d, sec_no, n, p);
+      c->cmd_cnt++;
+      c->sector_cnt += n;
+      p += n * BLOCK_SECTOR_SIZE;
+      sec_no += n;
+      cnt -= n;
+    }
+  channel_release (c);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes CNT consecutive sectors starting at SEC_NO to disk D
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the disk has acknowledged receiving all of the
+   data.  Each run of up to MAX_SECTORS_PER_CMD sectors takes a
+   single command, by DMA if possible and otherwise by PIO.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  const uint8_t *p = buffer;
+
+  channel_acquire (c);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_SECTORS_PER_CMD ? cnt : MAX_SECTORS_PER_CMD;
+
+      if (!dma_transfer (d, sec_no, n, (void *) p, false))
+        pio_write (d, sec_no, n, p);
+      c->cmd_cnt++;
+      c->sector_cnt += n;
+      p += n * BLOCK_SECTOR_SIZE;
+      sec_no += n;
+      cnt -= n;
+    }
+  channel_release (c);
+}
+
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void
+ide_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multiple (d_, sec_no, 1, buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data. */
+static void
+ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d_, sec_no, 1, buffer);
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple,
+    NULL
   };
-
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT, which must be between
+   1 and MAX_SECTORS_PER_CMD, to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sectors (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (sec_no + cnt <= (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_CMD);
 
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_SECTORS_PER_CMD);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -404,7 +676,7 @@ select_sector (struct ata_disk *d, block_sector_t sec_no)
 /* Writes COMMAND to channel C and prepares for receiving a
    completion interrupt. */
 static void
-issue_pio_command (struct channel *c, uint8_t command)
+issue_command (struct channel *c, uint8_t command)
 {
   /* Interrupts must be enabled or our semaphore will never be
      up'd by the completion handler. */
@@ -430,6 +702,67 @@ output_sector (struct channel *c, const void *sector)
   outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
 }
 
+/* Transfers CNT sectors, at most MAX_SECTORS_PER_CMD, between
+   disk D starting at SEC_NO and BUFFER by bus-master DMA, into
+   BUFFER if READ is true and out of it otherwise.  The thread
+   sleeps until the single completion interrupt, leaving the CPU
+   to others.  Returns false, having done nothing, if D or its
+   channel cannot do DMA or BUFFER is not a kernel address the
+   controller can reach.  Must be called with D's channel
+   locked. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool read)
+{
+  struct channel *c = d->channel;
+  uint32_t phys;
+  size_t left = cnt * BLOCK_SECTOR_SIZE;
+  size_t i;
+  uint8_t status;
+
+  if (!d->dma || c->bm_base == 0
+      || !is_kernel_vaddr (buffer) || ((uintptr_t) buffer & 1) != 0)
+    return false;
+
+  /* Describe BUFFER, which is physically contiguous because the
+     kernel maps physical memory linearly, as regions that do not
+     cross 64 kB boundaries. */
+  phys = vtop (buffer);
+  for (i = 0; left > 0; i++)
+    {
+      size_t n = 0x10000 - (phys & 0xffff);
+      if (n > left)
+        n = left;
+
+      ASSERT (i < PRD_CNT);
+      c->prdt[i].addr = phys;
+      c->prdt[i].size = n & 0xffff;
+      c->prdt[i].flags = 0;
+      phys += n;
+      left -= n;
+    }
+  c->prdt[i - 1].flags = PRD_EOT;
+
+  /* Set up the bus master, issue the command, then start the
+     bus master, in the order the PIIX datasheet gives. */
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), read ? BM_CMD_READ : 0);
+  outb (reg_bm_status (c), BM_STA_ERROR | BM_STA_INTR);
+  select_sectors (d, sec_no, cnt);
+  issue_command (c, read ? CMD_READ_DMA : CMD_WRITE_DMA);
+  outb (reg_bm_command (c), (read ? BM_CMD_READ : 0) | BM_CMD_START);
+
+  sema_down (&c->completion_wait);
+
+  outb (reg_bm_command (c), 0);
+  status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), BM_STA_ERROR | BM_STA_INTR);
+  if ((status & BM_STA_ERROR) || (inb (reg_alt_status (c)) & STA_ERR))
+    PANIC ("%s: DMA %s failed, sector=%"PRDSNu,
+           d->name, read ? "read" : "write", sec_no);
+  return true;
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
@@ -1,6 +1,10 @@
 #ifndef DEVICES_IDE_H
 #define DEVICES_IDE_H
 
+struct block;
+
 void ide_init (void);
+int ide_channel (struct block *);
+void ide_print_stats (void);
 
 #endif /* devices/ide.h */
@@ -0,0 +1,82 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/interrupt.h"
+#include "threads/io.h"
+
+/* The code in this file reads and writes PCI configuration space
+   through configuration mechanism #1, which every PC chipset
+   since the first PCI ones supports.  Only as much is here as
+   drivers need to find their device and its I/O ports. */
+
+/* Configuration mechanism #1 ports. */
+#define PCI_CONFIG_ADDR 0xcf8   /* Selects a register. */
+#define PCI_CONFIG_DATA 0xcfc   /* Reads or writes it. */
+
+/* Selects register REG of PCI function D for access through
+   PCI_CONFIG_DATA.  Must be called with interrupts off. */
+static void
+select_reg (const struct pci_dev *d, uint8_t reg)
+{
+  ASSERT (d->dev < 32 && d->func < 8);
+  outl (PCI_CONFIG_ADDR, (0x80000000 | (d->bus << 16) | (d->dev << 11)
+                          | (d->func << 8) | (reg & 0xfc)));
+}
+
+/* Returns the 32-bit configuration register REG, which must be a
+   multiple of 4, of PCI function D. */
+uint32_t
+pci_read_config (const struct pci_dev *d, uint8_t reg)
+{
+  enum intr_level old_level = intr_disable ();
+  uint32_t value;
+
+  select_reg (d, reg);
+  value = inl (PCI_CONFIG_DATA);
+  intr_set_level (old_level);
+  return value;
+}
+
+/* Writes VALUE to the 32-bit configuration register REG, which
+   must be a multiple of 4, of PCI function D. */
+void
+pci_write_config (const struct pci_dev *d, uint8_t reg, uint32_t value)
+{
+  enum intr_level old_level = intr_disable ();
+
+  select_reg (d, reg);
+  outl (PCI_CONFIG_DATA, value);
+  intr_set_level (old_level);
+}
+
+/* Searches bus 0 for a function with the given CLASS and
+   SUBCLASS.  If one is found, stores its location in *D and
+   returns true; otherwise, returns false. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_dev *d)
+{
+  d->bus = 0;
+  for (d->dev = 0; d->dev < 32; d->dev++)
+    for (d->func = 0; d->func < 8; d->func++)
+      {
+        uint32_t class_reg;
+
+        /* No device answers with all-ones vendor ID. */
+        if ((pci_read_config (d, PCI_REG_ID) & 0xffff) == 0xffff)
+          {
+            if (d->func == 0)
+              break;
+            continue;
+          }
+
+        class_reg = pci_read_config (d, PCI_REG_CLASS);
+        if ((class_reg >> 24) == class
+            && ((class_reg >> 16) & 0xff) == subclass)
+          return true;
+
+        /* Only multifunction devices have functions past 0. */
+        if (d->func == 0
+            && !(pci_read_config (d, PCI_REG_HEADER) & 0x00800000))
+          break;
+      }
+  return false;
+}
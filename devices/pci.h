@@ -0,0 +1,30 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Location of a function on the PCI bus. */
+struct pci_dev
+  {
+    uint8_t bus;                /* Bus number. */
+    uint8_t dev;                /* Device number, 0...31. */
+    uint8_t func;               /* Function number, 0...7. */
+  };
+
+/* Standard configuration space registers. */
+#define PCI_REG_ID 0x00         /* Device ID:Vendor ID. */
+#define PCI_REG_COMMAND 0x04    /* Status:Command. */
+#define PCI_REG_CLASS 0x08      /* Class:Subclass:Prog IF:Revision. */
+#define PCI_REG_HEADER 0x0c     /* BIST:Header type:Latency:Cache line. */
+#define PCI_REG_BAR0 0x10       /* Base address registers, 6 of them. */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* May act as a bus master. */
+
+uint32_t pci_read_config (const struct pci_dev *, uint8_t reg);
+void pci_write_config (const struct pci_dev *, uint8_t reg, uint32_t);
+bool pci_find_class (uint8_t class, uint8_t subclass, struct pci_dev *);
+
+#endif /* devices/pci.h */
@@ -0,0 +1,116 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A block device kept in kernel memory.  Its contents do not
+   survive a reboot, but it has no seek or transfer latency,
+   which makes it useful as a fast swap or scratch device and for
+   measuring file system code apart from disk speed.
+
+   The sectors live in pages allocated one at a time, since a
+   large run of contiguous pages is rarely available. */
+
+/* Sectors per page. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* A RAM disk. */
+struct ramdisk
+  {
+    uint8_t **pages;            /* Pages holding the sectors. */
+    size_t page_cnt;            /* Number of pages. */
+  };
+
+static struct block_operations ramdisk_operations;
+
+/* Creates a RAM disk of SIZE sectors named "ram0" and registers
+   it as a raw block device, so that it takes on a role only when
+   named in a kernel option such as -swap=ram0.  Panics if there
+   is not enough kernel memory. */
+void
+ramdisk_init (block_sector_t size)
+{
+  struct ramdisk *rd;
+  size_t i;
+
+  ASSERT (size > 0);
+
+  rd = malloc (sizeof *rd);
+  if (rd == NULL)
+    PANIC ("ram0: out of memory");
+  rd->page_cnt = DIV_ROUND_UP (size, SECTORS_PER_PAGE);
+  rd->pages = malloc (rd->page_cnt * sizeof *rd->pages);
+  if (rd->pages == NULL)
+    PANIC ("ram0: out of memory");
+  for (i = 0; i < rd->page_cnt; i++)
+    {
+      rd->pages[i] = palloc_get_page (PAL_ZERO);
+      if (rd->pages[i] == NULL)
+        PANIC ("ram0: out of memory after %zu of %zu pages",
+               i, rd->page_cnt);
+    }
+
+  block_register ("ram0", BLOCK_RAW, "RAM disk", size,
+                  &ramdisk_operations, rd);
+}
+
+/* Returns the address of sector SEC_NO of RD. */
+static uint8_t *
+sector_addr (struct ramdisk *rd, block_sector_t sec_no)
+{
+  return (rd->pages[sec_no / SECTORS_PER_PAGE]
+          + sec_no % SECTORS_PER_PAGE * BLOCK_SECTOR_SIZE);
+}
+
+/* Reads CNT sectors starting at SEC_NO from RAM disk RD_ into
+   BUFFER. */
+static void
+ramdisk_read_multiple (void *rd_, block_sector_t sec_no, size_t cnt,
+                       void *buffer)
+{
+  struct ramdisk *rd = rd_;
+  uint8_t *p = buffer;
+
+  for (; cnt > 0; cnt--, sec_no++, p += BLOCK_SECTOR_SIZE)
+    memcpy (p, sector_addr (rd, sec_no), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes CNT sectors starting at SEC_NO to RAM disk RD_ from
+   BUFFER. */
+static void
+ramdisk_write_multiple (void *rd_, block_sector_t sec_no, size_t cnt,
+                        const void *buffer)
+{
+  struct ramdisk *rd = rd_;
+  const uint8_t *p = buffer;
+
+  for (; cnt > 0; cnt--, sec_no++, p += BLOCK_SECTOR_SIZE)
+    memcpy (sector_addr (rd, sec_no), p, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads sector SEC_NO from RAM disk RD_ into BUFFER. */
+static void
+ramdisk_read (void *rd_, block_sector_t sec_no, void *buffer)
+{
+  ramdisk_read_multiple (rd_, sec_no, 1, buffer);
+}
+
+/* Writes sector SEC_NO to RAM disk RD_ from BUFFER. */
+static void
+ramdisk_write (void *rd_, block_sector_t sec_no, const void *buffer)
+{
+  ramdisk_write_multiple (rd_, sec_no, 1, buffer);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_read_multiple,
+    ramdisk_write_multiple,
+    NULL
+  };
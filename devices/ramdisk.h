@@ -0,0 +1,8 @@
+#ifndef DEVICES_RAMDISK_H
+#define DEVICES_RAMDISK_H
+
+#include "devices/block.h"
+
+void ramdisk_init (block_sector_t size);
+
+#endif /* devices/ramdisk.h */
@@ -0,0 +1,351 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* How often the write-behind thread flushes dirty sectors, in
+   timer ticks. */
+#define WRITE_BEHIND_TICKS (5 * TIMER_FREQ)
+
+/* Maximum number of outstanding read-ahead requests.  Requests
+   beyond this are dropped, since read-ahead is only a hint. */
+#define READ_AHEAD_CNT 16
+
+/* A cached sector.
+
+   The tag members (sector, valid, pin_cnt, accessed) are
+   protected by cache_lock.  The sector data and the dirty bit
+   are protected by the entry's own lock, which may only be
+   acquired by a thread that has pinned the entry, so that an
+   unpinned entry's lock is always free for the evictor. */
+struct cache_entry
+  {
+    block_sector_t sector;              /* Sector held, if valid. */
+    bool valid;                         /* True once SECTOR is assigned. */
+    bool accessed;                      /* Reference bit for clock. */
+    bool dirty;                         /* Needs to be written back? */
+    int pin_cnt;                        /* Users that block eviction. */
+    struct lock lock;                   /* Protects DATA and DIRTY. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+static struct cache_entry cache[CACHE_SIZE];
+static struct lock cache_lock;          /* Protects tags and clock hand. */
+static size_t clock_hand;               /* Next eviction candidate. */
+
+/* Read-ahead queue, a ring buffer of sector numbers. */
+static block_sector_t read_ahead_queue[READ_AHEAD_CNT];
+static size_t read_ahead_head, read_ahead_cnt;
+static struct lock read_ahead_lock;
+static struct condition read_ahead_cond;
+static bool read_ahead_stop;            /* Set by cache_done(). */
+static struct semaphore read_ahead_done; /* Upped as the thread exits. */
+
+/* Held by the write-behind thread while it writes. */
+static struct lock write_behind_lock;
+static bool write_behind_stop;          /* Set by cache_done(). */
+
+static thread_func write_behind_thread NO_RETURN;
+static thread_func read_ahead_thread NO_RETURN;
+
+/* Initializes the buffer cache and starts its write-behind and
+   read-ahead threads. */
+void
+cache_init (void)
+{
+  size_t i;
+
+  lock_init (&cache_lock);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      cache[i].valid = false;
+      cache[i].accessed = false;
+      cache[i].dirty = false;
+      cache[i].pin_cnt = 0;
+      lock_init (&cache[i].lock);
+    }
+  clock_hand = 0;
+
+  lock_init (&read_ahead_lock);
+  cond_init (&read_ahead_cond);
+  read_ahead_head = read_ahead_cnt = 0;
+  read_ahead_stop = false;
+  sema_init (&read_ahead_done, 0);
+
+  lock_init (&write_behind_lock);
+  write_behind_stop = false;
+
+  thread_create ("write-behind", PRI_DEFAULT, write_behind_thread, NULL);
+  thread_create ("read-ahead", PRI_DEFAULT, read_ahead_thread, NULL);
+}
+
+/* Returns the entry for SECTOR if it is cached, otherwise a null
+   pointer.  Must be called with cache_lock held. */
+static struct cache_entry *
+cache_find (block_sector_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].valid && cache[i].sector == sector)
+      return &cache[i];
+  return NULL;
+}
+
+/* Chooses an unpinned entry to hold a new sector, using the
+   clock algorithm, and writes it back if it is dirty.  Returns
+   a null pointer if every entry is pinned.  Must be called with
+   cache_lock held. */
+static struct cache_entry *
+cache_evict (void)
+{
+  size_t i;
+
+  for (i = 0; i < 2 * CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[clock_hand];
+      clock_hand = (clock_hand + 1) % CACHE_SIZE;
+
+      if (e->pin_cnt > 0)
+        continue;
+      if (e->valid && e->accessed)
+        {
+          e->accessed = false;
+          continue;
+        }
+
+      /* Write back while still holding cache_lock, so that nobody
+         can reread the old sector from disk before it lands. */
+      if (e->valid && e->dirty)
+        {
+          block_write (fs_device, e->sector, e->data);
+          e->dirty = false;
+        }
+      return e;
+    }
+  return NULL;
+}
+
+/* Returns the cache entry for SECTOR, pinned and with its lock
+   held.  If the sector is not cached, it is brought in, reading
+   it from disk only if FILL is true; otherwise its contents are
+   left for the caller to overwrite completely. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool fill)
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  for (;;)
+    {
+      e = cache_find (sector);
+      if (e != NULL)
+        {
+          e->pin_cnt++;
+          e->accessed = true;
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          return e;
+        }
+
+      e = cache_evict ();
+      if (e != NULL)
+        break;
+
+      /* Every entry is in use.  Let the users finish. */
+      lock_release (&cache_lock);
+      thread_yield ();
+      lock_acquire (&cache_lock);
+    }
+
+  /* E is unpinned, so nobody else holds its lock and this cannot
+     block while we hold cache_lock. */
+  lock_acquire (&e->lock);
+  e->sector = sector;
+  e->valid = true;
+  e->accessed = true;
+  e->dirty = false;
+  e->pin_cnt++;
+  lock_release (&cache_lock);
+
+  if (fill)
+    block_read (fs_device, sector, e->data);
+  return e;
+}
+
+/* Releases entry E obtained from cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+  lock_acquire (&cache_lock);
+  ASSERT (e->pin_cnt > 0);
+  e->pin_cnt--;
+  lock_release (&cache_lock);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within SECTOR
+   into BUFFER, through the cache. */
+void
+cache_read_at (block_sector_t sector, void *buffer, int ofs, int size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, true);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR starting at byte
+   offset OFS, through the cache.  The sector is written to disk
+   later, by the write-behind thread, eviction, or
+   cache_flush(). */
+void
+cache_write_at (block_sector_t sector, const void *buffer, int ofs, int size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  e->dirty = true;
+  cache_put (e);
+}
+
+/* Reads all of SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER to SECTOR. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Asks the read-ahead thread to bring SECTOR into the cache.
+   Returns without waiting for the read. */
+void
+cache_read_ahead (block_sector_t sector)
+{
+  lock_acquire (&read_ahead_lock);
+  if (!read_ahead_stop && read_ahead_cnt < READ_AHEAD_CNT)
+    {
+      read_ahead_queue[(read_ahead_head + read_ahead_cnt++)
+                       % READ_AHEAD_CNT] = sector;
+      cond_signal (&read_ahead_cond, &read_ahead_lock);
+    }
+  lock_release (&read_ahead_lock);
+}
+
+/* Writes every dirty cached sector back to disk. */
+void
+cache_flush (void)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+
+      lock_acquire (&cache_lock);
+      if (!e->valid || !e->dirty)
+        {
+          lock_release (&cache_lock);
+          continue;
+        }
+      e->pin_cnt++;
+      lock_release (&cache_lock);
+
+      lock_acquire (&e->lock);
+      if (e->dirty)
+        {
+          block_write (fs_device, e->sector, e->data);
+          e->dirty = false;
+        }
+      cache_put (e);
+    }
+}
+
+/* Stops the write-behind and read-ahead threads and writes
+   every dirty sector back to disk.  The caller should already
+   have synced the free map.  No sector is written behind the
+   final flush, since both threads are stopped first. */
+void
+cache_done (void)
+{
+  /* Stop read-ahead, dropping any queued requests, and wait for
+     a read already in progress to finish. */
+  lock_acquire (&read_ahead_lock);
+  read_ahead_stop = true;
+  cond_signal (&read_ahead_cond, &read_ahead_lock);
+  lock_release (&read_ahead_lock);
+  sema_down (&read_ahead_done);
+
+  /* Wait out a write-behind pass in progress.  The thread exits
+     without writing when it next wakes up. */
+  lock_acquire (&write_behind_lock);
+  write_behind_stop = true;
+  lock_release (&write_behind_lock);
+
+  cache_flush ();
+}
+
+/* Periodically flushes dirty sectors, including pending free
+   map changes, so that a crash loses at most WRITE_BEHIND_TICKS
+   worth of writes. */
+static void
+write_behind_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_sleep (WRITE_BEHIND_TICKS);
+
+      lock_acquire (&write_behind_lock);
+      if (write_behind_stop)
+        {
+          lock_release (&write_behind_lock);
+          thread_exit ();
+        }
+      free_map_sync ();
+      cache_flush ();
+      lock_release (&write_behind_lock);
+    }
+}
+
+/* Services requests queued by cache_read_ahead(). */
+static void
+read_ahead_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      block_sector_t sector;
+
+      lock_acquire (&read_ahead_lock);
+      while (read_ahead_cnt == 0 && !read_ahead_stop)
+        cond_wait (&read_ahead_cond, &read_ahead_lock);
+      if (read_ahead_stop)
+        {
+          lock_release (&read_ahead_lock);
+          sema_up (&read_ahead_done);
+          thread_exit ();
+        }
+      sector = read_ahead_queue[read_ahead_head];
+      read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_CNT;
+      read_ahead_cnt--;
+      lock_release (&read_ahead_lock);
+
+      cache_put (cache_get (sector, true));
+    }
+}
@@ -1,4 +1,7 @@
 #include "filesys/directory.h"
+#include <hash.h>
+#include <round.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
@@ -6,6 +9,16 @@
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
+/* A directory is a hash table of entries keyed by name.  The
+   first sector of the directory file holds a header.  Each
+   following sector is a bucket of entries.  A name hashes to a
+   home bucket.  If that bucket is full, the entry goes in the next
+   bucket with room, wrapping around, and each full bucket passed
+   on the way is flagged as having overflowed.  A lookup reads the
+   home bucket and continues only while buckets are flagged, so it
+   usually costs one sector read.  The table doubles and is
+   rehashed once it is more than 3/4 full. */
+
 /* A directory. */
 struct dir
   {
@@ -21,12 +34,78 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* Directory header, in the directory's first sector. */
+struct dir_header
+  {
+    uint32_t bucket_cnt;                /* Number of buckets. */
+    uint32_t entry_cnt;                 /* Number of entries in use. */
+  };
+
+/* Number of entries in a bucket. */
+#define BUCKET_ENTRY_CNT \
+  ((BLOCK_SECTOR_SIZE - sizeof (uint32_t)) / sizeof (struct dir_entry))
+
+/* A bucket of entries, one sector of the directory file. */
+struct dir_bucket
+  {
+    uint32_t overflow;                  /* Entries spilled past here? */
+    struct dir_entry entries[BUCKET_ENTRY_CNT];
+  };
+
+/* An empty bucket. */
+static const struct dir_bucket empty_bucket;
+
+/* Returns the byte offset of bucket B in a directory file. */
+static off_t
+bucket_ofs (size_t b)
+{
+  return (b + 1) * BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the byte offset of entry I of bucket B in a directory
+   file. */
+static off_t
+entry_ofs (size_t b, size_t i)
+{
+  return (bucket_ofs (b) + offsetof (struct dir_bucket, entries)
+          + i * sizeof (struct dir_entry));
+}
+
+/* Reads DIR's header into *H.  Returns true if successful. */
+static bool
+read_header (const struct dir *dir, struct dir_header *h)
+{
+  return inode_read_at (dir->inode, h, sizeof *h, 0) == sizeof *h;
+}
+
+/* Writes H as DIR's header.  Returns true if successful. */
+static bool
+write_header (struct dir *dir, const struct dir_header *h)
+{
+  return inode_write_at (dir->inode, h, sizeof *h, 0) == sizeof *h;
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  struct dir_header h;
+  struct inode *inode;
+  bool success;
+
+  /* Size the table to stay at most 3/4 full. */
+  h.bucket_cnt = DIV_ROUND_UP (entry_cnt * 4 / 3 + 1, BUCKET_ENTRY_CNT);
+  h.entry_cnt = 0;
+  if (!inode_create (sector, bucket_ofs (h.bucket_cnt)))
+    return false;
+
+  inode = inode_open (sector);
+  if (inode == NULL)
+    return false;
+  success = inode_write_at (inode, &h, sizeof h, 0) == sizeof h;
+  inode_close (inode);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -92,23 +171,119 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp)
 {
-  struct dir_entry e;
-  size_t ofs;
+  struct dir_header h;
+  struct dir_bucket bucket;
+  size_t b, i, probes;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (e.in_use && !strcmp (name, e.name))
+  if (!read_header (dir, &h) || h.bucket_cnt == 0)
+    return false;
+
+  b = hash_string (name) % h.bucket_cnt;
+  for (probes = 0; probes < h.bucket_cnt; probes++)
+    {
+      if (inode_read_at (dir->inode, &bucket, sizeof bucket, bucket_ofs (b))
+          != sizeof bucket)
+        return false;
+      for (i = 0; i < BUCKET_ENTRY_CNT; i++)
+        {
+          const struct dir_entry *e = &bucket.entries[i];
+          if (e->in_use && !strcmp (name, e->name))
+            {
+              if (ep != NULL)
+                *ep = *e;
+              if (ofsp != NULL)
+                *ofsp = entry_ofs (b, i);
+              return true;
+            }
+        }
+      if (!bucket.overflow)
+        break;
+      b = (b + 1) % h.bucket_cnt;
+    }
+  return false;
+}
+
+/* Stores E in a free slot of DIR's table, which has H->BUCKET_CNT
+   buckets, starting from E's home bucket.  Does not update the
+   header.  Returns true if successful, false if the table is
+   full or a disk error occurs. */
+static bool
+insert (struct dir *dir, const struct dir_header *h,
+        const struct dir_entry *e)
+{
+  struct dir_bucket bucket;
+  size_t b, i, probes;
+
+  b = hash_string (e->name) % h->bucket_cnt;
+  for (probes = 0; probes < h->bucket_cnt; probes++)
+    {
+      if (inode_read_at (dir->inode, &bucket, sizeof bucket, bucket_ofs (b))
+          != sizeof bucket)
+        return false;
+      for (i = 0; i < BUCKET_ENTRY_CNT; i++)
+        if (!bucket.entries[i].in_use)
+          return (inode_write_at (dir->inode, e, sizeof *e, entry_ofs (b, i))
+                  == sizeof *e);
+
+      /* Full: flag it so lookups keep probing past it. */
+      if (!bucket.overflow)
+        {
+          bucket.overflow = 1;
+          if (inode_write_at (dir->inode, &bucket.overflow,
+                              sizeof bucket.overflow, bucket_ofs (b))
+              != sizeof bucket.overflow)
+            return false;
+        }
+      b = (b + 1) % h->bucket_cnt;
+    }
+  return false;
+}
+
+/* Doubles the number of buckets in DIR, whose header is *H, and
+   rehashes its entries into them.  Updates *H but does not write
+   it.  Returns true if successful, false if out of memory or disk
+   space. */
+static bool
+grow (struct dir *dir, struct dir_header *h)
+{
+  struct dir_entry *entries;
+  size_t entry_cnt = 0;
+  size_t b, i;
+  bool success = true;
+
+  entries = malloc (h->entry_cnt * sizeof *entries + 1);
+  if (entries == NULL)
+    return false;
+
+  /* Gather the entries in use. */
+  for (b = 0; b < h->bucket_cnt; b++)
+    for (i = 0; i < BUCKET_ENTRY_CNT; i++)
       {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
+        struct dir_entry e;
+        if (inode_read_at (dir->inode, &e, sizeof e, entry_ofs (b, i))
+            != sizeof e)
+          {
+            free (entries);
+            return false;
+          }
+        if (e.in_use && entry_cnt < h->entry_cnt)
+          entries[entry_cnt++] = e;
       }
-  return false;
+
+  /* Clear all of the new table and put the entries back. */
+  h->bucket_cnt *= 2;
+  for (b = 0; b < h->bucket_cnt && success; b++)
+    success = (inode_write_at (dir->inode, &empty_bucket, sizeof empty_bucket,
+                               bucket_ofs (b))
+               == sizeof empty_bucket);
+  for (i = 0; i < entry_cnt && success; i++)
+    success = insert (dir, h, &entries[i]);
+
+  free (entries);
+  return success;
 }
 
 /* Searches DIR for a file with the given NAME
@@ -124,10 +299,12 @@ dir_lookup (const struct dir *dir, const char *name,
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  inode_lock_dir (dir->inode);
   if (lookup (dir, name, &e, NULL))
     *inode = inode_open (e.inode_sector);
   else
     *inode = NULL;
+  inode_unlock_dir (dir->inode);
 
   return *inode != NULL;
 }
@@ -141,8 +318,8 @@ dir_lookup (const struct dir *dir, const char *name,
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
+  struct dir_header h;
   struct dir_entry e;
-  off_t ofs;
   bool success = false;
 
   ASSERT (dir != NULL);
@@ -153,28 +330,32 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
     return false;
 
   /* Check that NAME is not in use. */
+  inode_lock_dir (dir->inode);
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (!e.in_use)
-      break;
+  /* Make room if the table would get more than 3/4 full. */
+  if (!read_header (dir, &h))
+    goto done;
+  if (h.bucket_cnt == 0)
+    h.bucket_cnt = 1;
+  else if ((h.entry_cnt + 1) * 4 > h.bucket_cnt * BUCKET_ENTRY_CNT * 3
+           && !grow (dir, &h))
+    goto done;
 
   /* Write slot. */
+  memset (&e, 0, sizeof e);
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (!insert (dir, &h, &e))
+    goto done;
+
+  h.entry_cnt++;
+  success = write_header (dir, &h);
 
  done:
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
@@ -184,6 +365,7 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 bool
 dir_remove (struct dir *dir, const char *name)
 {
+  struct dir_header h;
   struct dir_entry e;
   struct inode *inode = NULL;
   bool success = false;
@@ -193,6 +375,7 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (name != NULL);
 
   /* Find directory entry. */
+  inode_lock_dir (dir->inode);
   if (!lookup (dir, name, &e, &ofs))
     goto done;
 
@@ -201,36 +384,52 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
-  /* Erase directory entry. */
+  /* Erase directory entry.  Its bucket keeps any overflow flag,
+     since later entries may still depend on it. */
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
     goto done;
+  if (read_header (dir, &h))
+    {
+      h.entry_cnt--;
+      write_header (dir, &h);
+    }
 
   /* Remove inode. */
   inode_remove (inode);
   success = true;
 
  done:
+  inode_unlock_dir (dir->inode);
   inode_close (inode);
   return success;
 }
 
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
-   contains no more entries. */
+   contains no more entries.  Entries come back in hash order. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
+  struct dir_header h;
   struct dir_entry e;
+  bool found = false;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e)
-    {
-      dir->pos += sizeof e;
-      if (e.in_use)
-        {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
-        }
-    }
-  return false;
+  inode_lock_dir (dir->inode);
+  if (read_header (dir, &h))
+    while (!found && (size_t) dir->pos < h.bucket_cnt * BUCKET_ENTRY_CNT)
+      {
+        off_t ofs = entry_ofs (dir->pos / BUCKET_ENTRY_CNT,
+                               dir->pos % BUCKET_ENTRY_CNT);
+        dir->pos++;
+        if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+          break;
+        if (e.in_use)
+          {
+            strlcpy (name, e.name, NAME_MAX + 1);
+            found = true;
+          }
+      }
+  inode_unlock_dir (dir->inode);
+  return found;
 }
@@ -1,20 +1,37 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/synch.h"
+
+/* Number of free map bits stored in one sector of the free map
+   file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *dirty_map;     /* Free map file sectors to write. */
+static struct lock free_map_lock;    /* Protects the maps above. */
+
+static void mark_dirty (block_sector_t, size_t);
+static size_t run_length (size_t, size_t);
+static size_t longest_run (size_t, size_t, size_t *);
 
 /* Initializes the free map. */
 void
 free_map_init (void)
 {
+  lock_init (&free_map_lock);
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                           BITS_PER_SECTOR));
+  if (dirty_map == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
 }
@@ -22,31 +39,112 @@ free_map_init (void)
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available.  The change is written to the free
+   map file at the next free_map_sync(). */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  block_sector_t sector;
+
+  lock_acquire (&free_map_lock);
+  sector = bitmap_scan_and_flip_next (free_map, cnt, false);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false);
-      sector = BITMAP_ERROR;
+      mark_dirty (sector, cnt);
+      *sectorp = sector;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+  lock_release (&free_map_lock);
   return sector != BITMAP_ERROR;
 }
 
+/* Allocates up to CNT consecutive sectors from the free map,
+   near HINT, and stores the first into *SECTORP.  A free run
+   that starts exactly at HINT is taken first, since it extends
+   the caller's last extent.  Otherwise the first run of CNT free
+   sectors at or after HINT, wrapping around, is taken, or, if
+   there is none, the longest free run on the disk.  Returns the
+   number of sectors allocated, which is at least 1 unless the
+   disk is full, in which case it is 0. */
+size_t
+free_map_allocate_near (block_sector_t hint, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  size_t bit_cnt = bitmap_size (free_map);
+  size_t sector, n;
+
+  ASSERT (cnt > 0);
+
+  if (hint >= bit_cnt)
+    hint = 0;
+
+  lock_acquire (&free_map_lock);
+  if (!bitmap_test (free_map, hint))
+    {
+      sector = hint;
+      n = run_length (hint, cnt);
+    }
+  else
+    {
+      sector = bitmap_scan (free_map, hint, cnt, false);
+      if (sector == BITMAP_ERROR)
+        sector = bitmap_scan (free_map, 0, cnt, false);
+      n = cnt;
+      if (sector == BITMAP_ERROR)
+        n = longest_run (hint, cnt, &sector);
+    }
+  if (n == 0)
+    {
+      lock_release (&free_map_lock);
+      return 0;
+    }
+
+  bitmap_set_multiple (free_map, sector, n, true);
+  mark_dirty (sector, n);
+  lock_release (&free_map_lock);
+
+  *sectorp = sector;
+  return n;
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  mark_dirty (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Writes the sectors of the free map file that changed since
+   the last sync back to the file, leaving the rest alone.  The
+   writes go to the buffer cache, which takes them to disk at
+   write-behind or at cache_done(). */
+void
+free_map_sync (void)
+{
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file == NULL)
+    {
+      lock_release (&free_map_lock);
+      return;
+    }
+  for (i = bitmap_scan (dirty_map, 0, 1, true); i != BITMAP_ERROR;
+       i = bitmap_scan (dirty_map, i + 1, 1, true))
+    {
+      size_t start = i * BITS_PER_SECTOR;
+      size_t cnt = bitmap_size (free_map) - start;
+      if (cnt > BITS_PER_SECTOR)
+        cnt = BITS_PER_SECTOR;
+
+      if (!bitmap_write_range (free_map, free_map_file, start, cnt))
+        PANIC ("can't write free map");
+      bitmap_reset (dirty_map, i);
+    }
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +156,23 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  bitmap_set_all (dirty_map, false);
 }
 
-/* Writes the free map to disk and closes the free map file. */
+/* Writes the changed free map sectors to the free map file and
+   closes it.  They are in the buffer cache until filesys_done()
+   calls cache_done(). */
 void
 free_map_close (void)
 {
-  file_close (free_map_file);
+  struct file *file;
+
+  free_map_sync ();
+  lock_acquire (&free_map_lock);
+  file = free_map_file;
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
+  file_close (file);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -82,4 +190,70 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_map, false);
+}
+
+/* Marks the free map file sectors that hold the bits for CNT
+   sectors starting at SECTOR as needing to be written.  Must be
+   called with free_map_lock held. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first, last;
+
+  if (cnt == 0)
+    return;
+  first = sector / BITS_PER_SECTOR;
+  last = (sector + cnt - 1) / BITS_PER_SECTOR;
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
+
+/* Returns the number of free sectors starting at free sector
+   START, counting no more than CNT.  Must be called with
+   free_map_lock held. */
+static size_t
+run_length (size_t start, size_t cnt)
+{
+  size_t end = bitmap_scan (free_map, start, 1, true);
+
+  if (end == BITMAP_ERROR)
+    end = bitmap_size (free_map);
+  return end - start < cnt ? end - start : cnt;
+}
+
+/* Finds the longest free run in the free map, counting no more
+   than CNT sectors of any run, and stores its first sector into
+   *SECTORP.  Runs are visited starting at HINT and wrapping
+   around, and the first of equally long runs wins.  Returns the
+   run's length, or 0 if no sector is free.  Must be called with
+   free_map_lock held. */
+static size_t
+longest_run (size_t hint, size_t cnt, size_t *sectorp)
+{
+  size_t bit_cnt = bitmap_size (free_map);
+  size_t best = 0;
+  size_t pass;
+
+  for (pass = 0; pass < 2; pass++)
+    {
+      size_t start = pass == 0 ? hint : 0;
+      size_t end = pass == 0 ? bit_cnt : hint;
+
+      while (start < end)
+        {
+          size_t n;
+
+          start = bitmap_scan (free_map, start, 1, false);
+          if (start == BITMAP_ERROR || start >= end)
+            break;
+          n = run_length (start, cnt);
+          if (n > best)
+            {
+              best = n;
+              *sectorp = start;
+            }
+          start += n;
+        }
+    }
+  return best;
 }
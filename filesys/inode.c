@@ -1,23 +1,52 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of extents stored directly in the on-disk inode. */
+#define DIRECT_EXTENT_CNT 61
+
+/* Number of extents stored in the indirect extent block. */
+#define INDIRECT_EXTENT_CNT (BLOCK_SECTOR_SIZE / sizeof (struct extent))
+
+/* Maximum number of extents in one file. */
+#define MAX_EXTENT_CNT (DIRECT_EXTENT_CNT + INDIRECT_EXTENT_CNT)
+
+/* Number of closed inodes kept in memory for reopening. */
+#define CLOSED_INODE_CNT 32
+
+/* A run of LENGTH consecutive data sectors starting at START. */
+struct extent
+  {
+    block_sector_t start;               /* First sector. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   File data lives in EXTENT_CNT extents, in file order.  The
+   first DIRECT_EXTENT_CNT are stored here, the rest in the
+   INDIRECT sector, which is allocated only once needed. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t sector_cnt;                /* Data sectors allocated. */
+    uint32_t extent_cnt;                /* Number of extents in use. */
+    block_sector_t indirect;            /* Indirect extent block. */
+    struct extent extents[DIRECT_EXTENT_CNT];   /* Direct extents. */
+    uint32_t unused[1];                 /* Not used. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -28,17 +57,59 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* In-memory inode.
+
+   ELEM, CLOSED_ELEM, OPEN_CNT and REMOVED are protected by
+   open_inodes_lock.  An inode whose OPEN_CNT drops to 0 may
+   stay in open_inodes, on the closed_inodes list, until it is
+   reopened or pushed out by more recently closed inodes.
+   DATA, DENY_WRITE_CNT and the file's contents are protected by
+   RW: reads share it, while writes, which may extend the file,
+   hold it exclusively.  DIR_LOCK serializes operations on the
+   entries of a directory, which read and write its contents
+   through RW like any other file. */
 struct inode
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
+    struct list_elem closed_elem;       /* Element in closed_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    struct rwlock rw;                   /* Protects data and contents. */
+    struct lock dir_lock;               /* Directory operations. */
     struct inode_disk data;             /* Inode content. */
   };
 
+/* A sector's worth of zeros, for initializing new sectors. */
+static char zeros[BLOCK_SECTOR_SIZE];
+
+/* Stores extent IDX of DISK_INODE into *E. */
+static void
+get_extent (const struct inode_disk *disk_inode, size_t idx,
+            struct extent *e)
+{
+  ASSERT (idx < disk_inode->extent_cnt);
+  if (idx < DIRECT_EXTENT_CNT)
+    *e = disk_inode->extents[idx];
+  else
+    cache_read_at (disk_inode->indirect, e,
+                   (idx - DIRECT_EXTENT_CNT) * sizeof *e, sizeof *e);
+}
+
+/* Stores E as extent IDX of DISK_INODE.  The indirect block must
+   already exist if IDX calls for it. */
+static void
+set_extent (struct inode_disk *disk_inode, size_t idx,
+            const struct extent *e)
+{
+  if (idx < DIRECT_EXTENT_CNT)
+    disk_inode->extents[idx] = *e;
+  else
+    cache_write_at (disk_inode->indirect, e,
+                    (idx - DIRECT_EXTENT_CNT) * sizeof *e, sizeof *e);
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
@@ -46,22 +117,172 @@ struct inode
 static block_sector_t
 byte_to_sector (const struct inode *inode, off_t pos)
 {
+  const struct inode_disk *disk_inode;
+  size_t sector_ofs, i;
+
   ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
-  else
+  disk_inode = &inode->data;
+  sector_ofs = pos / BLOCK_SECTOR_SIZE;
+  if (pos < 0 || sector_ofs >= disk_inode->sector_cnt)
     return -1;
+
+  for (i = 0; i < disk_inode->extent_cnt; i++)
+    {
+      struct extent e;
+
+      get_extent (disk_inode, i, &e);
+      if (sector_ofs < e.length)
+        return e.start + sector_ofs;
+      sector_ofs -= e.length;
+    }
+  NOT_REACHED ();
+}
+
+/* Appends CNT sectors starting at START to DISK_INODE, whose
+   inode is in sector INODE_SECTOR, merging them into the last
+   extent if they are contiguous with it.  Returns true if
+   successful, false if the extent list is full or the indirect
+   block cannot be allocated. */
+static bool
+append_extent (struct inode_disk *disk_inode, block_sector_t inode_sector,
+               block_sector_t start, size_t cnt)
+{
+  struct extent e;
+  size_t idx = disk_inode->extent_cnt;
+
+  if (idx > 0)
+    {
+      get_extent (disk_inode, idx - 1, &e);
+      if (e.start + e.length == start)
+        {
+          e.length += cnt;
+          set_extent (disk_inode, idx - 1, &e);
+          disk_inode->sector_cnt += cnt;
+          return true;
+        }
+    }
+
+  if (idx >= MAX_EXTENT_CNT)
+    return false;
+  if (idx == DIRECT_EXTENT_CNT)
+    {
+      if (free_map_allocate_near (inode_sector, 1,
+                                  &disk_inode->indirect) == 0)
+        return false;
+      cache_write (disk_inode->indirect, zeros);
+    }
+
+  e.start = start;
+  e.length = cnt;
+  disk_inode->extent_cnt++;
+  set_extent (disk_inode, idx, &e);
+  disk_inode->sector_cnt += cnt;
+  return true;
+}
+
+/* Allocates and zeroes enough data sectors for DISK_INODE, whose
+   inode is in sector INODE_SECTOR, to hold LENGTH bytes.  New
+   sectors are placed as close as possible after the file's last
+   sector, so that files written sequentially stay mostly
+   contiguous.  Returns true if successful, false if the disk or
+   the extent list is full.  On failure, DISK_INODE keeps
+   whatever sectors were allocated before running out. */
+static bool
+extend (struct inode_disk *disk_inode, block_sector_t inode_sector,
+        off_t length)
+{
+  size_t sectors = bytes_to_sectors (length);
+
+  while (disk_inode->sector_cnt < sectors)
+    {
+      block_sector_t hint = inode_sector + 1;
+      block_sector_t start;
+      size_t cnt, i;
+
+      if (disk_inode->extent_cnt > 0)
+        {
+          struct extent e;
+
+          get_extent (disk_inode, disk_inode->extent_cnt - 1, &e);
+          hint = e.start + e.length;
+        }
+
+      cnt = free_map_allocate_near (hint,
+                                    sectors - disk_inode->sector_cnt,
+                                    &start);
+      if (cnt == 0)
+        return false;
+      if (!append_extent (disk_inode, inode_sector, start, cnt))
+        {
+          free_map_release (start, cnt);
+          return false;
+        }
+      for (i = 0; i < cnt; i++)
+        cache_write (start + i, zeros);
+    }
+  return true;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Releases all of DISK_INODE's data sectors and its indirect
+   extent block, if any, to the free map. */
+static void
+release_extents (struct inode_disk *disk_inode)
+{
+  size_t i;
+
+  for (i = 0; i < disk_inode->extent_cnt; i++)
+    {
+      struct extent e;
+
+      get_extent (disk_inode, i, &e);
+      free_map_release (e.start, e.length);
+    }
+  if (disk_inode->extent_cnt > DIRECT_EXTENT_CNT)
+    free_map_release (disk_inode->indirect, 1);
+  disk_inode->extent_cnt = 0;
+  disk_inode->sector_cnt = 0;
+}
+
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  Also holds the inodes
+   on closed_inodes. */
+static struct hash open_inodes;
+
+/* Recently closed inodes, most recently closed first.  Reopening
+   one of these needs no disk access. */
+static struct list closed_inodes;
+static size_t closed_inode_cnt;
+
+static struct lock open_inodes_lock;    /* Protects the above. */
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
+  hash_init (&open_inodes, inode_hash, inode_less, NULL);
+  list_init (&closed_inodes);
+  closed_inode_cnt = 0;
+  lock_init (&open_inodes_lock);
+}
+
+/* Returns a hash value for the inode in E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->sector);
+}
+
+/* Returns true if the inode in A precedes the one in B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -84,22 +305,15 @@ inode_create (block_sector_t sector, off_t length)
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start))
+      if (extend (disk_inode, sector, length))
         {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0)
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-
-              for (i = 0; i < sectors; i++)
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
+          cache_write (sector, disk_inode);
           success = true;
         }
+      else
+        release_extents (disk_inode);
       free (disk_inode);
     }
   return success;
@@ -111,33 +325,46 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
+  /* Check whether this inode is already open, or was closed
+     recently enough to still be in memory. */
+  lock_acquire (&open_inodes_lock);
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
+      inode = hash_entry (e, struct inode, elem);
+      if (inode->open_cnt++ == 0)
         {
-          inode_reopen (inode);
-          return inode;
+          list_remove (&inode->closed_elem);
+          closed_inode_cnt--;
         }
+      lock_release (&open_inodes_lock);
+      return inode;
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The inode is read before it is published, so
+     that nobody sees it half-filled. */
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  rw_init (&inode->rw);
+  lock_init (&inode->dir_lock);
+  cache_read (inode->sector, &inode->data);
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -146,7 +373,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -158,31 +389,51 @@ inode_get_inumber (const struct inode *inode)
 }
 
 /* Closes INODE and writes it to disk.
-   If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If this was the last reference to INODE, it is kept in memory
+   among the recently closed inodes, unless it was removed, in
+   which case its blocks and memory are freed. */
 void
 inode_close (struct inode *inode)
 {
+  struct inode *victim = NULL;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&open_inodes_lock);
+  if (--inode->open_cnt > 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      lock_release (&open_inodes_lock);
+      return;
+    }
 
-      /* Deallocate blocks if removed. */
-      if (inode->removed)
-        {
-          free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length));
-        }
+  if (inode->removed)
+    {
+      /* Remove from inode table and release lock. */
+      hash_delete (&open_inodes, &inode->elem);
+      lock_release (&open_inodes_lock);
 
+      /* Deallocate blocks. */
+      free_map_release (inode->sector, 1);
+      release_extents (&inode->data);
       free (inode);
+      return;
+    }
+
+  /* Keep it around, making room by forgetting the least recently
+     closed inode if necessary. */
+  list_push_front (&closed_inodes, &inode->closed_elem);
+  if (++closed_inode_cnt > CLOSED_INODE_CNT)
+    {
+      victim = list_entry (list_pop_back (&closed_inodes),
+                           struct inode, closed_elem);
+      closed_inode_cnt--;
+      hash_delete (&open_inodes, &victim->elem);
     }
+  lock_release (&open_inodes_lock);
+  free (victim);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -191,7 +442,9 @@ void
 inode_remove (struct inode *inode)
 {
   ASSERT (inode != NULL);
+  lock_acquire (&open_inodes_lock);
   inode->removed = true;
+  lock_release (&open_inodes_lock);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -202,8 +455,8 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
+  rw_read_acquire (&inode->rw);
   while (size > 0)
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -220,50 +473,51 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL)
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      cache_read_at (sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+
+  /* Start fetching the sector after the last one we touched, on
+     the guess that the caller is reading sequentially. */
+  if (bytes_read > 0 && offset < inode_length (inode))
+    cache_read_ahead (byte_to_sector (inode, offset));
+  rw_read_release (&inode->rw);
 
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if an error occurs.  A write past end of file
+   extends the inode; if the disk is too full to do so, only the
+   bytes that fit within the old length are written. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset)
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  off_t length;
+  uint32_t old_sector_cnt;
 
+  rw_write_acquire (&inode->rw);
   if (inode->deny_write_cnt)
-    return 0;
+    {
+      rw_write_release (&inode->rw);
+      return 0;
+    }
+  length = inode->data.length;
+  old_sector_cnt = inode->data.sector_cnt;
+
+  /* Allocate sectors before writing, but publish the new length
+     only after the data is in place. */
+  if (size > 0 && offset + size > length
+      && extend (&inode->data, inode->sector, offset + size))
+    length = offset + size;
 
   while (size > 0)
     {
@@ -272,7 +526,7 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      off_t inode_left = length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -281,38 +535,24 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL)
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left)
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
-        }
+      cache_write_at (sector_idx, buffer + bytes_written, sector_ofs,
+                      chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  /* Even a failed extension may have allocated sectors, which
+     must be recorded on disk so they are not leaked. */
+  if (length > inode->data.length
+      || inode->data.sector_cnt != old_sector_cnt)
+    {
+      inode->data.length = length;
+      cache_write (inode->sector, &inode->data);
+    }
+  rw_write_release (&inode->rw);
 
   return bytes_written;
 }
@@ -322,8 +562,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode)
 {
+  rw_write_acquire (&inode->rw);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  rw_write_release (&inode->rw);
 }
 
 /* Re-enables writes to INODE.
@@ -332,9 +574,11 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode)
 {
+  rw_write_acquire (&inode->rw);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rw_write_release (&inode->rw);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -343,3 +587,19 @@ inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Acquires INODE's directory lock, which keeps other threads
+   from looking up, adding or removing entries while the caller
+   does so. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Releases INODE's directory lock. */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
+}
@@ -0,0 +1,98 @@
+#ifndef __LIB_FIXED_POINT_H
+#define __LIB_FIXED_POINT_H
+
+#include <stdint.h>
+
+/* Signed 17.14 fixed-point numbers: 17 integer bits and 14
+   fraction bits in an int.  N below is an int, X and Y are
+   fixed-point numbers.
+
+   Products and quotients of two fixed-point numbers go through
+   64 bits so that the intermediate result cannot overflow. */
+typedef int fixed_point;
+
+/* Number of fraction bits. */
+#define FIX_SHIFT 14
+
+/* 1.0 in fixed point. */
+#define FIX_ONE (1 << FIX_SHIFT)
+
+/* Returns N as a fixed-point number. */
+static inline fixed_point
+fix_int (int n)
+{
+  return n * FIX_ONE;
+}
+
+/* Returns X truncated toward zero to an integer. */
+static inline int
+fix_trunc (fixed_point x)
+{
+  return x / FIX_ONE;
+}
+
+/* Returns X rounded to the nearest integer. */
+static inline int
+fix_round (fixed_point x)
+{
+  return (x >= 0 ? (x + FIX_ONE / 2) / FIX_ONE
+          : (x - FIX_ONE / 2) / FIX_ONE);
+}
+
+/* Returns X + Y. */
+static inline fixed_point
+fix_add (fixed_point x, fixed_point y)
+{
+  return x + y;
+}
+
+/* Returns X - Y. */
+static inline fixed_point
+fix_sub (fixed_point x, fixed_point y)
+{
+  return x - y;
+}
+
+/* Returns X + N. */
+static inline fixed_point
+fix_add_int (fixed_point x, int n)
+{
+  return x + n * FIX_ONE;
+}
+
+/* Returns X - N. */
+static inline fixed_point
+fix_sub_int (fixed_point x, int n)
+{
+  return x - n * FIX_ONE;
+}
+
+/* Returns X * Y. */
+static inline fixed_point
+fix_mul (fixed_point x, fixed_point y)
+{
+  return ((int64_t) x) * y / FIX_ONE;
+}
+
+/* Returns X * N. */
+static inline fixed_point
+fix_mul_int (fixed_point x, int n)
+{
+  return x * n;
+}
+
+/* Returns X / Y. */
+static inline fixed_point
+fix_div (fixed_point x, fixed_point y)
+{
+  return ((int64_t) x) * FIX_ONE / y;
+}
+
+/* Returns X / N. */
+static inline fixed_point
+fix_div_int (fixed_point x, int n)
+{
+  return x / n;
+}
+
+#endif /* lib/fixed-point.h */
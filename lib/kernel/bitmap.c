@@ -27,6 +27,7 @@ typedef unsigned long elem_type;
 struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
+    size_t next_fit;    /* Where bitmap_scan_and_flip_next() starts. */
     elem_type *bits;    /* Elements that represent bits. */
   };
 
@@ -69,6 +70,68 @@ last_mask (const struct bitmap *b)
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 
+/* Returns element IDX of B, inverted if VALUE is false, so that
+   the bits set in the result are those equal to VALUE. */
+static inline elem_type
+elem_matching (const struct bitmap *b, size_t idx, bool value)
+{
+  return value ? b->bits[idx] : ~b->bits[idx];
+}
+
+/* Returns a mask of the bits in the element containing bit
+   START that are numbered START or higher. */
+static inline elem_type
+high_mask (size_t start)
+{
+  return (elem_type) -1 << (start % ELEM_BITS);
+}
+
+/* Returns the index of the lowest set bit in nonzero X.
+   This compiles to a single BSF instruction. */
+static inline size_t
+lowest_bit (elem_type x)
+{
+  return __builtin_ctzl (x);
+}
+
+/* Returns the number of set bits in X.  We don't use
+   __builtin_popcountl() because, without a POPCNT instruction,
+   GCC turns it into a call into libgcc, which we don't link. */
+static inline size_t
+count_bits (elem_type x)
+{
+  x = x - ((x >> 1) & 0x55555555);
+  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+  x = (x + (x >> 4)) & 0x0f0f0f0f;
+  return (x * 0x01010101) >> 24;
+}
+
+/* Returns the index of the first bit in B numbered at least
+   START and less than END that is set to VALUE, or END if there
+   is none.  Whole elements that contain no such bit are skipped
+   at once. */
+static size_t
+find_next (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  size_t idx;
+  elem_type x;
+
+  if (start >= end)
+    return end;
+
+  idx = elem_idx (start);
+  x = elem_matching (b, idx, value) & high_mask (start);
+  while (x == 0)
+    {
+      if (++idx * ELEM_BITS >= end)
+        return end;
+      x = elem_matching (b, idx, value);
+    }
+
+  start = idx * ELEM_BITS + lowest_bit (x);
+  return start < end ? start : end;
+}
+
 /* Creation and destruction. */
 
 /* Creates and returns a pointer to a newly allocated bitmap with room for
@@ -82,6 +145,7 @@ bitmap_create (size_t bit_cnt)
   if (b != NULL)
     {
       b->bit_cnt = bit_cnt;
+      b->next_fit = 0;
       b->bits = malloc (byte_cnt (bit_cnt));
       if (b->bits != NULL || bit_cnt == 0)
         {
@@ -104,6 +168,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
   ASSERT (block_size >= bitmap_buf_size (bit_cnt));
 
   b->bit_cnt = bit_cnt;
+  b->next_fit = 0;
   b->bits = (elem_type *) (b + 1);
   bitmap_set_all (b, false);
   return b;
@@ -213,18 +278,35 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Each element is updated atomically, as in bitmap_set(). */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i;
+  size_t end = start + cnt;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      size_t elem_end = (idx + 1) * ELEM_BITS;
+      elem_type mask = high_mask (start);
+
+      if (end < elem_end)
+        mask &= ~high_mask (end);
+
+      /* See bitmap_mark() and bitmap_reset() for why we use
+         inline assembly here. */
+      if (value)
+        asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+      else
+        asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+
+      start = elem_end;
+    }
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -232,16 +314,26 @@ bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i, value_cnt;
+  size_t end = start + cnt;
+  size_t value_cnt;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
   value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      value_cnt++;
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      size_t elem_end = (idx + 1) * ELEM_BITS;
+      elem_type x = elem_matching (b, idx, value) & high_mask (start);
+
+      if (end < elem_end)
+        x &= ~high_mask (end);
+      value_cnt += count_bits (x);
+
+      start = elem_end;
+    }
   return value_cnt;
 }
 
@@ -250,16 +342,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i;
-
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return find_next (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -298,13 +385,25 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt)
+  if (cnt > b->bit_cnt)
+    return BITMAP_ERROR;
+  if (cnt == 0)
+    return start;
+
+  /* Jump from each run of VALUE bits to the next, instead of
+     testing every possible starting position. */
+  while (start + cnt <= b->bit_cnt)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i;
+      size_t end;
+
+      start = find_next (b, start, b->bit_cnt, value);
+      if (start + cnt > b->bit_cnt)
+        break;
+
+      end = find_next (b, start, start + cnt, !value);
+      if (end == start + cnt)
+        return start;
+      start = end;
     }
   return BITMAP_ERROR;
 }
@@ -324,7 +423,31 @@ bitmap_scan_and_flip (struct bitmap *b, size_t start, size_t cnt, bool value)
     bitmap_set_multiple (b, idx, cnt, !value);
   return idx;
 }
-
+
+/* Like bitmap_scan_and_flip(), but starts searching just past
+   the group found by the previous call (next fit), wrapping
+   around to the start of B if necessary.  This keeps repeated
+   allocations from rescanning the same full prefix of B. */
+size_t
+bitmap_scan_and_flip_next (struct bitmap *b, size_t cnt, bool value)
+{
+  size_t idx;
+
+  ASSERT (b != NULL);
+
+  if (b->next_fit > b->bit_cnt)
+    b->next_fit = 0;
+  idx = bitmap_scan (b, b->next_fit, cnt, value);
+  if (idx == BITMAP_ERROR && b->next_fit != 0)
+    idx = bitmap_scan (b, 0, cnt, value);
+  if (idx != BITMAP_ERROR)
+    {
+      bitmap_set_multiple (b, idx, cnt, !value);
+      b->next_fit = idx + cnt;
+    }
+  return idx;
+}
+
 /* File input and output. */
 
 #ifdef FILESYS
@@ -358,6 +481,27 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the bytes of B that hold bits START through START + CNT
+   - 1 to the same position in FILE, so that a file written by
+   bitmap_write() can be brought up to date without rewriting
+   all of it.  Return true if successful, false otherwise. */
+bool
+bitmap_write_range (const struct bitmap *b, struct file *file,
+                    size_t start, size_t cnt)
+{
+  off_t ofs, size;
+
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (start + cnt <= b->bit_cnt);
+
+  if (cnt == 0)
+    return true;
+  ofs = start / CHAR_BIT;
+  size = byte_cnt (start + cnt) - ofs;
+  return file_write_at (file, (const uint8_t *) b->bits + ofs,
+                        size, ofs) == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
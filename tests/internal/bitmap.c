@@ -0,0 +1,141 @@
+/* Test program for lib/kernel/bitmap.c.
+
+   Compares the word-at-a-time scanning and counting routines
+   against straightforward bit-by-bit versions on randomly
+   filled bitmaps of many sizes and densities.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <random.h>
+#include <stdio.h>
+#include "threads/test.h"
+
+/* Maximum number of bits in a bitmap that we will test. */
+#define MAX_SIZE 200
+
+/* Number of random bitmaps to try for each size. */
+#define REPEAT 8
+
+static void fill (struct bitmap *, int density);
+static size_t ref_count (const struct bitmap *, size_t start, size_t cnt,
+                         bool value);
+static size_t ref_scan (const struct bitmap *, size_t start, size_t cnt,
+                        bool value);
+
+/* Test the bitmap implementation. */
+void
+test (void)
+{
+  size_t size;
+
+  printf ("testing various size bitmaps:");
+  for (size = 0; size <= MAX_SIZE; size++)
+    {
+      int repeat;
+
+      if (size % 10 == 0)
+        printf (" %zu", size);
+      for (repeat = 0; repeat < REPEAT; repeat++)
+        {
+          struct bitmap *b = bitmap_create (size);
+          size_t start, cnt;
+          int value;
+
+          ASSERT (b != NULL);
+          fill (b, repeat * 100 / (REPEAT - 1));
+
+          for (value = 0; value <= 1; value++)
+            for (start = 0; start <= size; start++)
+              for (cnt = 0; start + cnt <= size && cnt <= 40; cnt++)
+                {
+                  size_t n = ref_count (b, start, cnt, value);
+
+                  ASSERT (bitmap_count (b, start, cnt, value) == n);
+                  ASSERT (bitmap_contains (b, start, cnt, value) == (n > 0));
+                  ASSERT (bitmap_scan (b, start, cnt, value)
+                          == ref_scan (b, start, cnt, value));
+                }
+
+          /* Setting a range must touch exactly that range. */
+          if (size > 0)
+            {
+              size_t before = bitmap_count (b, 0, size, true);
+
+              start = random_ulong () % size;
+              cnt = random_ulong () % (size - start + 1);
+              value = random_ulong () % 2;
+              before -= ref_count (b, start, cnt, true);
+              bitmap_set_multiple (b, start, cnt, value);
+              ASSERT (ref_count (b, start, cnt, value) == cnt);
+              ASSERT (bitmap_count (b, 0, size, true)
+                      == before + (value ? cnt : 0));
+            }
+
+          bitmap_destroy (b);
+        }
+    }
+  printf (" done\n");
+
+  printf ("testing next-fit allocation:");
+  {
+    struct bitmap *b = bitmap_create (MAX_SIZE);
+    size_t i;
+
+    ASSERT (b != NULL);
+    for (i = 0; i < MAX_SIZE / 4; i++)
+      ASSERT (bitmap_scan_and_flip_next (b, 4, false) == i * 4);
+    ASSERT (bitmap_scan_and_flip_next (b, 1, false) == BITMAP_ERROR);
+
+    /* After freeing an early group, the search wraps to find it. */
+    bitmap_set_multiple (b, 8, 4, false);
+    ASSERT (bitmap_scan_and_flip_next (b, 4, false) == 8);
+    ASSERT (bitmap_all (b, 0, MAX_SIZE));
+    bitmap_destroy (b);
+  }
+  printf (" done\n");
+}
+
+/* Sets each bit in B with probability DENSITY percent. */
+static void
+fill (struct bitmap *b, int density)
+{
+  size_t i;
+
+  for (i = 0; i < bitmap_size (b); i++)
+    bitmap_set (b, i, (int) (random_ulong () % 100) < density);
+}
+
+/* Counts the bits in B from START to START + CNT that are set
+   to VALUE, one bit at a time. */
+static size_t
+ref_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < cnt; i++)
+    if (bitmap_test (b, start + i) == value)
+      n++;
+  return n;
+}
+
+/* The original bitmap_scan(): tries every starting position at
+   or after START in turn. */
+static size_t
+ref_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  if (cnt <= bitmap_size (b))
+    {
+      size_t last = bitmap_size (b) - cnt;
+      size_t i;
+
+      for (i = start; i <= last; i++)
+        if (ref_count (b, i, cnt, !value) == 0)
+          return i;
+    }
+  return BITMAP_ERROR;
+}
@@ -34,6 +34,7 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -56,6 +57,9 @@ static const char *scratch_bdev_name;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
+
+/* -ramdisk: Size of RAM disk to create, in kB, or 0 for none. */
+static size_t ramdisk_kb;
 #endif /* FILESYS */
 
 /* -ul: Maximum number of pages to put into palloc's user pool. */
@@ -130,6 +134,8 @@ main (void)
 #ifdef FILESYS
   /* Initialize file system. */
   ide_init ();
+  if (ramdisk_kb > 0)
+    ramdisk_init (ramdisk_kb * 1024 / BLOCK_SECTOR_SIZE);
   locate_block_devices ();
   filesys_init (format_filesys);
 #endif
@@ -258,6 +264,14 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-ramdisk"))
+        ramdisk_kb = atoi (value);
+      else if (!strcmp (name, "-iosched"))
+        {
+          if (value == NULL || !block_set_scheduler (value))
+            PANIC ("unknown I/O scheduler `%s' (use -h for help)",
+                   value != NULL ? value : "");
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -270,6 +284,10 @@ parse_options (char **argv)
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
+#endif
+#ifdef VM
+      else if (!strcmp (name, "-age"))
+        frame_age_window = atoi (value);
 #endif
       else
         PANIC ("unknown option `%s' (use -h for help)", name);
@@ -384,6 +402,10 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -ramdisk=KB        Create a KB-kilobyte RAM disk named ram0, for\n"
+          "                     use with -filesys, -scratch, or -swap.\n"
+          "  -iosched=NAME      Order disk requests with I/O scheduler NAME,\n"
+          "                     noop or elevator (the default).\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -392,6 +414,9 @@ usage (void)
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+          "  -age=TICKS         Set the page eviction aging window to TICKS.\n"
 #endif
           );
   shutdown_power_off ();
@@ -412,7 +437,8 @@ locate_block_devices (void)
 /* Figures out what block device to use for the given ROLE: the
    block device with the given NAME, if NAME is non-null,
    otherwise the first block device in probe order of type
-   ROLE. */
+   ROLE, except that swap goes on another IDE channel than the
+   file system if it can. */
 static void
 locate_block_device (enum block_type role, const char *name)
 {
@@ -429,6 +455,22 @@ locate_block_device (enum block_type role, const char *name)
       for (block = block_first (); block != NULL; block = block_next (block))
         if (block_type (block) == role)
           break;
+
+      /* Prefer to swap on a different IDE channel from the file
+         system, so that paging and file I/O can run at once. */
+      if (role == BLOCK_SWAP && block != NULL
+          && block_get_role (BLOCK_FILESYS) != NULL)
+        {
+          int fs_channel = ide_channel (block_get_role (BLOCK_FILESYS));
+          struct block *b;
+
+          for (b = block; b != NULL; b = block_next (b))
+            if (block_type (b) == role && ide_channel (b) != fs_channel)
+              {
+                block = b;
+                break;
+              }
+        }
     }
 
   if (block != NULL)
@@ -20,8 +20,10 @@ void sema_self_test (void);
 /* Lock. */
 struct lock
   {
-    struct thread *holder;      /* Thread holding lock (for debugging). */
+    struct thread *holder;      /* Thread holding lock. */
     struct semaphore semaphore; /* Binary semaphore controlling access. */
+    int priority;               /* Highest priority donated by waiters. */
+    struct list_elem elem;      /* Element in holder's held_locks. */
   };
 
 void lock_init (struct lock *);
@@ -41,6 +43,26 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock.
+   Any number of readers may hold it at once, or a single writer.
+   Waiting writers keep new readers out, so writers do not
+   starve. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition readers_ok; /* Signaled when readers may enter. */
+    struct condition writer_ok; /* Signaled when a writer may enter. */
+    int reader_cnt;             /* Number of readers holding it. */
+    int writer_cnt;             /* Writers waiting or holding it. */
+    struct thread *writer;      /* Writer holding it, if any. */
+  };
+
+void rw_init (struct rwlock *);
+void rw_read_acquire (struct rwlock *);
+void rw_read_release (struct rwlock *);
+void rw_write_acquire (struct rwlock *);
+void rw_write_release (struct rwlock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include "devices/timer.h"
 #include "threads/flags.h"
 #include "threads/interrupt.h"
 #include "threads/intr-stubs.h"
@@ -24,9 +25,17 @@
    of thread.h for details. */
 #define THREAD_MAGIC 0xcd6abf4b
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
+/* Processes in THREAD_READY state, that is, processes that are
+   ready to run but not actually running, with one FIFO queue per
+   priority.  Bit P of ready_bits is set if and only if
+   ready_queues[P] is nonempty, so the highest-priority ready
+   thread can be found without looking at every queue. */
+#define PRI_CNT (PRI_MAX - PRI_MIN + 1)
+#define READY_WORD_BITS 32
+#define READY_WORD_CNT ((PRI_CNT + READY_WORD_BITS - 1) / READY_WORD_BITS)
+static struct list ready_queues[PRI_CNT];
+static uint32_t ready_bits[READY_WORD_CNT];
+static int ready_cnt;           /* Number of threads in ready_queues. */
 
 /* List of all processes.  Processes are added to this list
    when they are first scheduled and removed when they exit. */
@@ -63,8 +72,20 @@ static unsigned thread_ticks;   /* # of timer ticks since last yield. */
    Controlled by kernel command-line option "-o mlfqs". */
 bool thread_mlfqs;
 
+/* Estimated average number of threads ready to run over the past
+   minute, for the multi-level feedback queue scheduler. */
+static fixed_point load_avg;
+
 static void kernel_thread (thread_func *, void *aux);
 
+static void ready_push (struct thread *);
+static void ready_remove (struct thread *);
+static int ready_max_priority (void);
+static void set_priority (struct thread *, int priority);
+static void mlfqs_update_priority (struct thread *, void *aux);
+static void mlfqs_update_recent_cpu (struct thread *, void *aux);
+static void mlfqs_second (void);
+
 static void idle (void *aux UNUSED);
 static struct thread *running_thread (void);
 static struct thread *next_thread_to_run (void);
@@ -91,10 +112,16 @@ static tid_t allocate_tid (void);
 void
 thread_init (void)
 {
+  int i;
+
   ASSERT (intr_get_level () == INTR_OFF);
 
   lock_init (&tid_lock);
-  list_init (&ready_list);
+  for (i = 0; i < PRI_CNT; i++)
+    list_init (&ready_queues[i]);
+  memset (ready_bits, 0, sizeof ready_bits);
+  ready_cnt = 0;
+  load_avg = 0;
   list_init (&all_list);
 
   /* Set up a thread structure for the running thread. */
@@ -138,6 +165,24 @@ thread_tick (void)
   else
     kernel_ticks++;
 
+  /* Update the multi-level feedback queue scheduler's state.
+     Between once-a-second updates, only the running thread's
+     recent_cpu changes, so only its priority needs recomputing,
+     which keeps the cost per tick independent of the number of
+     threads. */
+  if (thread_mlfqs)
+    {
+      int64_t now = timer_ticks ();
+
+      if (t != idle_thread)
+        t->recent_cpu = fix_add_int (t->recent_cpu, 1);
+      if (now % TIMER_FREQ == 0)
+        mlfqs_second ();
+      else if (now % 4 == 0 && t != idle_thread)
+        mlfqs_update_priority (t, NULL);
+      thread_preempt ();
+    }
+
   /* Enforce preemption. */
   if (++thread_ticks >= TIME_SLICE)
     intr_yield_on_return ();
@@ -163,9 +208,8 @@ thread_print_stats (void)
    scheduled.  Use a semaphore or some other form of
    synchronization if you need to ensure ordering.
 
-   The code provided sets the new thread's `priority' member to
-   PRIORITY, but no actual priority scheduling is implemented.
-   Priority scheduling is the goal of Problem 1-3. */
+   If the new thread has a higher priority than the running
+   thread, it preempts the running thread immediately. */
 tid_t
 thread_create (const char *name, int priority,
                thread_func *function, void *aux)
@@ -212,6 +256,7 @@ thread_create (const char *name, int priority,
 
   /* Add to run queue. */
   thread_unblock (t);
+  thread_preempt ();
 
   return tid;
 }
@@ -239,7 +284,8 @@ thread_block (void)
    This function does not preempt the running thread.  This can
    be important: if the caller had disabled interrupts itself,
    it may expect that it can atomically unblock a thread and
-   update other data. */
+   update other data.  Callers call thread_preempt() afterward
+   if T should be able to run at once. */
 void
 thread_unblock (struct thread *t)
 {
@@ -249,7 +295,7 @@ thread_unblock (struct thread *t)
 
   old_level = intr_disable ();
   ASSERT (t->status == THREAD_BLOCKED);
-  list_push_back (&ready_list, &t->elem);
+  ready_push (t);
   t->status = THREAD_READY;
   intr_set_level (old_level);
 }
@@ -324,12 +370,32 @@ thread_yield (void)
 
   old_level = intr_disable ();
   if (cur != idle_thread)
-    list_push_back (&ready_list, &cur->elem);
+    ready_push (cur);
   cur->status = THREAD_READY;
   schedule ();
   intr_set_level (old_level);
 }
 
+/* Yields the CPU if a thread of higher priority than the running
+   thread is ready.  In an interrupt handler, the yield happens
+   on return from the interrupt. */
+void
+thread_preempt (void)
+{
+  enum intr_level old_level = intr_disable ();
+  bool yield = (thread_current () != idle_thread
+                && ready_max_priority () > thread_current ()->priority);
+  intr_set_level (old_level);
+
+  if (yield)
+    {
+      if (intr_context ())
+        intr_yield_on_return ();
+      else
+        thread_yield ();
+    }
+}
+
 /* Invoke function 'func' on all threads, passing along 'aux'.
    This function must be called with interrupts off. */
 void
@@ -347,49 +413,175 @@ thread_foreach (thread_action_func *func, void *aux)
     }
 }
 
-/* Sets the current thread's priority to NEW_PRIORITY. */
+/* Sets the current thread's base priority to NEW_PRIORITY.  A
+   higher priority donated to it still applies until the donating
+   lock is released.  Yields if the running thread no longer has
+   the highest priority. */
 void
 thread_set_priority (int new_priority)
 {
-  thread_current ()->priority = new_priority;
+  enum intr_level old_level;
+
+  ASSERT (PRI_MIN <= new_priority && new_priority <= PRI_MAX);
+
+  /* The multi-level feedback queue scheduler sets priorities
+     itself. */
+  if (thread_mlfqs)
+    return;
+
+  old_level = intr_disable ();
+  thread_current ()->base_priority = new_priority;
+  thread_update_priority (thread_current ());
+  intr_set_level (old_level);
+  thread_preempt ();
 }
 
-/* Returns the current thread's priority. */
+/* Recomputes T's priority as the higher of its base priority and
+   the priorities donated through the locks it holds, and moves T
+   to the matching ready queue if it is ready.  Must be called
+   with interrupts off. */
+void
+thread_update_priority (struct thread *t)
+{
+  struct list_elem *e;
+  int priority = t->base_priority;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  for (e = list_begin (&t->held_locks); e != list_end (&t->held_locks);
+       e = list_next (e))
+    {
+      struct lock *l = list_entry (e, struct lock, elem);
+      if (l->priority > priority)
+        priority = l->priority;
+    }
+  set_priority (t, priority);
+}
+
+/* Sets T's effective priority to PRIORITY, moving T to the
+   matching ready queue if it is ready.  Must be called with
+   interrupts off. */
+static void
+set_priority (struct thread *t, int priority)
+{
+  if (priority != t->priority)
+    {
+      if (t->status == THREAD_READY)
+        {
+          ready_remove (t);
+          t->priority = priority;
+          ready_push (t);
+        }
+      else
+        t->priority = priority;
+    }
+}
+
+/* Returns the current thread's priority, including donations. */
 int
 thread_get_priority (void)
 {
   return thread_current ()->priority;
 }
 
-/* Sets the current thread's nice value to NICE. */
+/* Sets the current thread's nice value to NICE and recomputes
+   its priority, yielding if it no longer has the highest
+   priority. */
 void
-thread_set_nice (int nice UNUSED)
+thread_set_nice (int nice)
 {
-  /* Not yet implemented. */
+  enum intr_level old_level;
+
+  ASSERT (NICE_MIN <= nice && nice <= NICE_MAX);
+
+  old_level = intr_disable ();
+  thread_current ()->nice = nice;
+  if (thread_mlfqs)
+    mlfqs_update_priority (thread_current (), NULL);
+  intr_set_level (old_level);
+  thread_preempt ();
 }
 
 /* Returns the current thread's nice value. */
 int
 thread_get_nice (void)
 {
-  /* Not yet implemented. */
-  return 0;
+  return thread_current ()->nice;
 }
 
 /* Returns 100 times the system load average. */
 int
 thread_get_load_avg (void)
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  int load = fix_round (fix_mul_int (load_avg, 100));
+  intr_set_level (old_level);
+  return load;
 }
 
 /* Returns 100 times the current thread's recent_cpu value. */
 int
 thread_get_recent_cpu (void)
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  int recent = fix_round (fix_mul_int (thread_current ()->recent_cpu, 100));
+  intr_set_level (old_level);
+  return recent;
+}
+
+/* Sets T's priority from its recent_cpu and nice values, as
+   PRI_MAX - recent_cpu / 4 - nice * 2, clamped to the valid
+   range.  Must be called with interrupts off. */
+static void
+mlfqs_update_priority (struct thread *t, void *aux UNUSED)
+{
+  int priority;
+
+  if (t == idle_thread)
+    return;
+
+  priority = PRI_MAX - fix_trunc (fix_div_int (t->recent_cpu, 4))
+             - t->nice * 2;
+  if (priority < PRI_MIN)
+    priority = PRI_MIN;
+  else if (priority > PRI_MAX)
+    priority = PRI_MAX;
+
+  /* No priority is donated under this scheduler. */
+  t->base_priority = priority;
+  set_priority (t, priority);
+}
+
+/* Decays T's recent_cpu by the factor in *AUX, which is
+   (2 * load_avg) / (2 * load_avg + 1), and adds its nice value.
+   Must be called with interrupts off. */
+static void
+mlfqs_update_recent_cpu (struct thread *t, void *aux)
+{
+  fixed_point *decay = aux;
+
+  if (t == idle_thread)
+    return;
+  t->recent_cpu = fix_add_int (fix_mul (*decay, t->recent_cpu), t->nice);
+}
+
+/* Once-a-second update for the multi-level feedback queue
+   scheduler: recomputes load_avg, then every thread's recent_cpu
+   and priority.  Must be called with interrupts off. */
+static void
+mlfqs_second (void)
+{
+  int ready = ready_cnt + (thread_current () != idle_thread);
+  fixed_point twice_load;
+  fixed_point decay;
+
+  load_avg = fix_add (fix_mul (fix_div_int (fix_int (59), 60), load_avg),
+                      fix_div_int (fix_int (ready), 60));
+
+  twice_load = fix_mul_int (load_avg, 2);
+  decay = fix_div (twice_load, fix_add_int (twice_load, 1));
+  thread_foreach (mlfqs_update_recent_cpu, &decay);
+  thread_foreach (mlfqs_update_priority, NULL);
 }
 
 /* Idle thread.  Executes when no other thread is ready to run.
@@ -477,19 +669,34 @@ init_thread (struct thread *t, const char *name, int priority)
   t->status = THREAD_BLOCKED;
   strlcpy (t->name, name, sizeof t->name);
   t->stack = (uint8_t *) t + PGSIZE;
-  t->priority = priority;
+  t->priority = t->base_priority = priority;
+  list_init (&t->held_locks);
+  t->waiting_lock = NULL;
+  if (t != running_thread ())
+    {
+      /* Inherit the creating thread's scheduling state. */
+      t->nice = running_thread ()->nice;
+      t->recent_cpu = running_thread ()->recent_cpu;
+    }
   t->magic = THREAD_MAGIC;
 #ifdef USERPROG
   t->parent = running_thread();
   list_init(&t->children);
-  list_init(&t->opened_files);
-  t->num_fd = 2;
+  t->fd_table = NULL;
+  t->fd_map = NULL;
+  t->fd_cnt = 0;
   sema_init(&t->wait, 0);
   t->wait_for = 0;
   t->exit_status = NULL_EXIT_STATUS;
 #endif
+#ifdef VM
+  list_init(&t->mmaps);
+  t->num_mapid = 0;
+#endif
 
   old_level = intr_disable ();
+  if (thread_mlfqs)
+    mlfqs_update_priority (t, NULL);
   list_push_back (&all_list, &t->allelem);
   intr_set_level (old_level);
 }
@@ -507,18 +714,70 @@ alloc_frame (struct thread *t, size_t size)
   return t->stack;
 }
 
+/* Adds T to the back of the ready queue for its priority.  Must
+   be called with interrupts off. */
+static void
+ready_push (struct thread *t)
+{
+  int pri = t->priority - PRI_MIN;
+
+  list_push_back (&ready_queues[pri], &t->elem);
+  ready_cnt++;
+  ready_bits[pri / READY_WORD_BITS] |= 1u << (pri % READY_WORD_BITS);
+}
+
+/* Removes ready thread T from its ready queue.  Must be called
+   with interrupts off. */
+static void
+ready_remove (struct thread *t)
+{
+  int pri = t->priority - PRI_MIN;
+
+  list_remove (&t->elem);
+  ready_cnt--;
+  if (list_empty (&ready_queues[pri]))
+    ready_bits[pri / READY_WORD_BITS] &= ~(1u << (pri % READY_WORD_BITS));
+}
+
+/* Returns the highest priority of any ready thread, or PRI_MIN - 1
+   if no thread is ready.  Must be called with interrupts off. */
+static int
+ready_max_priority (void)
+{
+  int i;
+
+  for (i = READY_WORD_CNT - 1; i >= 0; i--)
+    if (ready_bits[i] != 0)
+      return (PRI_MIN + i * READY_WORD_BITS
+              + (READY_WORD_BITS - 1 - __builtin_clz (ready_bits[i])));
+  return PRI_MIN - 1;
+}
+
 /* Chooses and returns the next thread to be scheduled.  Should
    return a thread from the run queue, unless the run queue is
    empty.  (If the running thread can continue running, then it
    will be in the run queue.)  If the run queue is empty, return
-   idle_thread. */
+   idle_thread.
+
+   The thread chosen is the one that has waited longest among
+   those of the highest priority.  Finding it takes a bit scan
+   of ready_bits and a list pop, however many threads are
+   ready. */
 static struct thread *
 next_thread_to_run (void)
 {
-  if (list_empty (&ready_list))
+  int pri = ready_max_priority ();
+  struct list_elem *e;
+
+  if (pri < PRI_MIN)
     return idle_thread;
-  else
-    return list_entry (list_pop_front (&ready_list), struct thread, elem);
+
+  pri -= PRI_MIN;
+  e = list_pop_front (&ready_queues[pri]);
+  ready_cnt--;
+  if (list_empty (&ready_queues[pri]))
+    ready_bits[pri / READY_WORD_BITS] &= ~(1u << (pri % READY_WORD_BITS));
+  return list_entry (e, struct thread, elem);
 }
 
 /* Completes a thread switch by activating the new thread's page
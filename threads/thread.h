@@ -2,6 +2,7 @@
 #define THREADS_THREAD_H
 
 #include <debug.h>
+#include <fixed-point.h>
 #include <list.h>
 #include <hash.h>
 #include <stdint.h>
@@ -78,10 +79,11 @@ typedef int tid_t;
    value, triggering the assertion. */
 /* The `elem' member has a dual purpose.  It can be an element in
    the run queue (thread.c), or it can be an element in a
-   semaphore wait list (synch.c).  It can be used these two ways
-   only because they are mutually exclusive: only a thread in the
-   ready state is on the run queue, whereas only a thread in the
-   blocked state is on a semaphore wait list. */
+   semaphore wait list (synch.c) or the timer's sleep list
+   (devices/timer.c).  It can be used these ways only because
+   they are mutually exclusive: only a thread in the ready state
+   is on the run queue, whereas only a thread in the blocked
+   state is on a semaphore wait list or the sleep list. */
 #define NULL_EXIT_STATUS -1000
 struct child {
 	tid_t tid;
@@ -96,12 +98,25 @@ struct thread
     enum thread_status status;          /* Thread state. */
     char name[16];                      /* Name (for debugging purposes). */
     uint8_t *stack;                     /* Saved stack pointer. */
-    int priority;                       /* Priority. */
+    int priority;                       /* Priority, with donations. */
+    int base_priority;                  /* Priority, without donations. */
     struct list_elem allelem;           /* List element for all threads list. */
 
-    /* Shared between thread.c and synch.c. */
+    /* Shared between thread.c, synch.c and devices/timer.c. */
     struct list_elem elem;              /* List element. */
 
+    /* Shared between thread.c and synch.c. */
+    struct list held_locks;             /* Locks held, for donation. */
+    struct lock *waiting_lock;          /* Lock being waited for, if any. */
+
+    /* Owned by thread.c, for the multi-level feedback queue
+       scheduler. */
+    int nice;                           /* Niceness, -20 to 20. */
+    fixed_point recent_cpu;             /* Recent CPU time received. */
+
+    /* Owned by devices/timer.c. */
+    int64_t wake_tick;                  /* Tick to wake from timer_sleep(). */
+
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
 
@@ -112,8 +127,9 @@ struct thread
     struct thread* parent;/* Parent thread */
     struct list children;/* Children threads */
 
-    struct list opened_files;/*list of opened files */
-    int num_fd;/*number of file descriptors*/
+    struct file **fd_table;/*opened files indexed by fd, NULL if unused*/
+    struct bitmap *fd_map;/*fds in use, for lowest free fd allocation*/
+    size_t fd_cnt;/*number of slots in fd_table*/
 
     struct semaphore wait;
     tid_t wait_for;
@@ -127,6 +143,9 @@ struct thread
     struct hash supp_page_table;
 
     void* vsp;
+
+    struct list mmaps;/*list of memory mapped files*/
+    int num_mapid;/*next mapping id*/
 #endif
   };
 
@@ -153,6 +172,7 @@ const char *thread_name (void);
 
 void thread_exit (void) NO_RETURN;
 void thread_yield (void);
+void thread_preempt (void);
 
 /* Performs some operation on thread t, given auxiliary data AUX. */
 typedef void thread_action_func (struct thread *t, void *aux);
@@ -160,6 +180,11 @@ void thread_foreach (thread_action_func *, void *);
 
 int thread_get_priority (void);
 void thread_set_priority (int);
+void thread_update_priority (struct thread *);
+
+/* Range of nice values. */
+#define NICE_MIN -20                    /* Nicest. */
+#define NICE_MAX 20                     /* Least nice. */
 
 int thread_get_nice (void);
 void thread_set_nice (int);
@@ -212,6 +212,7 @@ process_exit (void)
   if (pd != NULL)
     {
 #ifdef VM
+      munmap_all();
       page_table_destroy(&cur->supp_page_table);
 #endif
       /* Correct ordering here is crucial.  We must set
@@ -228,18 +229,9 @@ process_exit (void)
 #ifdef USERPROG
   if(cur->executable_file!=NULL)
   {
-	  lock_acquire(&filesys_lock);
 	  file_close(cur->executable_file);
-	  lock_release(&filesys_lock);
-  }
-  struct list_elem *elem;
-  while(!list_empty(&cur->opened_files)){
-	  elem = list_pop_front(&cur->opened_files);
-	  struct thread_file *f = list_entry (elem, struct thread_file, elem);
-	  file_close(f->fp);
-	  list_remove(elem);
-	  free(f);
   }
+  fd_close_all();
 #endif
 }
 
@@ -352,7 +344,6 @@ load (const char *file_name, void (**eip) (void), void **esp)
 #endif
 
   /* Open executable file. */
-  lock_acquire(&filesys_lock);
   file = filesys_open (file_name);
   if (file == NULL)
     {
@@ -445,7 +436,6 @@ load (const char *file_name, void (**eip) (void), void **esp)
 
  done:
   /* We arrive here whether the load is successful or not. */
-  lock_release(&filesys_lock);
   return success;
 }
 
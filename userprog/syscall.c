@@ -5,6 +5,8 @@
 #include "threads/thread.h"
 #include "threads/vaddr.h"
 #include "threads/synch.h"
+#include "threads/malloc.h"
+#include <bitmap.h>
 #include "filesys/filesys.h"
 #include "filesys/file.h"
 #include "devices/input.h"
@@ -35,13 +37,16 @@ void check_addr_string(const char *addr);
 void unpin_all_buffer(const void *addr, int size);
 void unpin_all_string(const char *str);
 #endif
+#ifdef VM
+int mmap (int fd, void *addr);
+void munmap (int mapid);
+#endif
 
 static void syscall_handler (struct intr_frame *);
 
 void
 syscall_init (void)
 {
-	lock_init(&filesys_lock);
 	intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
@@ -97,9 +102,7 @@ syscall_handler (struct intr_frame *f UNUSED)
 		check_addr_string(*(sp + 1));
 		char *file_name = (char *) *(sp + 1);
 
-		lock_acquire(&filesys_lock);
 		f->eax = create(file_name, file_size);
-		lock_release(&filesys_lock);
 		unpin_all_string(file_name);
 		break;
 	}
@@ -107,10 +110,8 @@ syscall_handler (struct intr_frame *f UNUSED)
 	case SYS_REMOVE:{//DONE
 		check_addr(sp + 1);
 		check_addr_string(*(sp + 1));
-		lock_acquire(&filesys_lock);
 		char *file_name = (char *) *(sp + 1);
 		f->eax = remove(file_name);
-		lock_release(&filesys_lock);
 		unpin_all_string(file_name);
 		break;
 	}
@@ -118,10 +119,8 @@ syscall_handler (struct intr_frame *f UNUSED)
 	case SYS_OPEN: {//DONE
 		check_addr(sp + 1);
 		check_addr_string(*(sp + 1));
-		lock_acquire(&filesys_lock);
 		char *file_name = (char *) *(sp + 1);
 		struct file* fp = filesys_open(file_name);
-		lock_release(&filesys_lock);
 		if(!fp){
 			f->eax = -1;
 		}
@@ -135,10 +134,8 @@ syscall_handler (struct intr_frame *f UNUSED)
 
 	case SYS_FILESIZE:{//DOME
 		check_addr(sp + 1);
-		lock_acquire(&filesys_lock);
 		unsigned int fd = *(sp + 1);
 		f->eax = filesize(fd);
-		lock_release(&filesys_lock);
 		break;
 	}
 
@@ -181,7 +178,7 @@ syscall_handler (struct intr_frame *f UNUSED)
 	case SYS_TELL:{//DONE
 		check_addr(sp + 1);
 		unsigned int fd = *(sp + 1);
-		tell(fd);
+		f->eax = tell(fd);
 		break;
 	}
 	case SYS_CLOSE:{//DONE
@@ -190,6 +187,22 @@ syscall_handler (struct intr_frame *f UNUSED)
 		close(fd);
 		break;
 	}
+#endif
+#ifdef VM
+	case SYS_MMAP:{
+		check_addr(sp + 1);
+		check_addr(sp + 2);
+		int fd = *(sp + 1);
+		void *addr = (void *) *(sp + 2);
+		f->eax = mmap(fd, addr);
+		break;
+	}
+	case SYS_MUNMAP:{
+		check_addr(sp + 1);
+		int mapid = *(sp + 1);
+		munmap(mapid);
+		break;
+	}
 #endif
 	default:
 		if(call_no >= 0 && call_no <= 20){
@@ -240,19 +253,16 @@ int exec (const char *command){
 	char *executable_name = strtok_r(command_cp, " ", &saveptr);
 
 
-	lock_acquire(&filesys_lock);
 	/* see if the executable name is valid */
 	struct file* f = filesys_open (executable_name);
 
 
 	if(f == NULL){/* if not valid */
-		lock_release(&filesys_lock);
 		return -1;
 	}
 
 	/* if valid */
 	file_close(f);
-	lock_release(&filesys_lock);
 	return process_execute(command);
 }
 
@@ -268,57 +278,104 @@ bool remove (const char *file){
 	return filesys_remove(file);
 }
 
-int open (const struct file *fp){
+/* first size of a process's fd table, which doubles when it fills */
+#define FD_TABLE_INIT 16
+
+/* gives FP the lowest free file descriptor of the current process,
+ * growing its fd table if every slot is taken. Returns -1 if out of
+ * memory */
+static int fd_alloc (struct file *fp){
+	struct thread *cur_thread = thread_current();
+
+	if(cur_thread->fd_map == NULL || bitmap_all(cur_thread->fd_map, 0, cur_thread->fd_cnt)){
+		size_t new_cnt = cur_thread->fd_cnt == 0 ? FD_TABLE_INIT : cur_thread->fd_cnt * 2;
+		struct file **new_table = realloc(cur_thread->fd_table, new_cnt * sizeof *new_table);
+		if(new_table == NULL)
+			return -1;
+		cur_thread->fd_table = new_table;
+
+		struct bitmap *new_map = bitmap_create(new_cnt);
+		if(new_map == NULL)
+			return -1;
+		/* 0 and 1 are the console */
+		bitmap_set_multiple(new_map, 0, 2, true);
+		size_t i;
+		for(i = 2; i < new_cnt; i++){
+			if(i >= cur_thread->fd_cnt)
+				new_table[i] = NULL;
+			else if(new_table[i] != NULL)
+				bitmap_mark(new_map, i);
+		}
+		if(cur_thread->fd_map != NULL)
+			bitmap_destroy(cur_thread->fd_map);
+		cur_thread->fd_map = new_map;
+		cur_thread->fd_cnt = new_cnt;
+	}
+
+	int fd = bitmap_scan_and_flip(cur_thread->fd_map, 0, 1, false);
+	ASSERT(fd != (int) BITMAP_ERROR);
+	cur_thread->fd_table[fd] = fp;
+	return fd;
+}
+
+/* returns the file open as FD in the current process, NULL if none */
+static struct file *fd_lookup (int fd){
 	struct thread *cur_thread = thread_current();
-	struct thread_file *tf = malloc(sizeof(struct thread_file));
-	tf->fd = cur_thread->num_fd;
-	tf->fp = fp;
-	cur_thread->num_fd ++;
-	list_push_back(&cur_thread->opened_files, &tf->elem);
-	return tf->fd;
+	if(fd < 2 || (size_t) fd >= cur_thread->fd_cnt)
+		return NULL;
+	return cur_thread->fd_table[fd];
+}
+
+/* closes every file the current process has open, at exit */
+void fd_close_all (void){
+	struct thread *cur_thread = thread_current();
+	size_t i;
+
+	for(i = 2; i < cur_thread->fd_cnt; i++){
+		if(cur_thread->fd_table[i] != NULL){
+			file_close(cur_thread->fd_table[i]);
+		}
+	}
+	free(cur_thread->fd_table);
+	if(cur_thread->fd_map != NULL)
+		bitmap_destroy(cur_thread->fd_map);
+	cur_thread->fd_table = NULL;
+	cur_thread->fd_map = NULL;
+	cur_thread->fd_cnt = 0;
+}
+
+int open (const struct file *fp){
+	int fd = fd_alloc((struct file *) fp);
+	if(fd == -1){
+		file_close((struct file *) fp);
+	}
+	return fd;
 }
 
 int filesize (int fd){
-	struct thread_file* tf = NULL;
-	/* start searching for a file with file descriptor number fd*/
-	struct list_elem *e;
-	for (e = list_begin(&thread_current()->opened_files); e != list_end (&thread_current()->opened_files); e = list_next (e)){
-	  tf = list_entry (e, struct thread_file, elem);
-	  if(tf->fd == fd){
-		break;
-	  }
+	struct file *fp = fd_lookup(fd);
+	if(fp == NULL){
+		return -1;
 	}
-	return file_length(tf->fp);
+	return file_length(fp);
 }
 
 int read (int fd, void *buffer, unsigned size){
 	char* real_buffer = (char *) buffer;
 	if(fd == 0){//read from stdin
-		int i;
+		unsigned i;
 		for(i=0; i < size; i++){
 			real_buffer[i] = input_getc();
 		}
 		return size;
 	}
 	else{//from from a file
-		struct thread_file* tf = NULL;
-		/* start searching for a file with file descriptor number fd*/
-		struct list_elem *e;
-		for (e = list_begin(&thread_current()->opened_files); e != list_end (&thread_current()->opened_files); e = list_next (e))
-		{
-		  tf = list_entry (e, struct thread_file, elem);
-		  if(tf->fd == fd){
-			break;
-		  }
-		}
-
-		if(tf == NULL){
+		struct file *fp = fd_lookup(fd);
+		if(fp == NULL){
 			return -1;
 		}
 		else{
-			lock_acquire(&filesys_lock);
-			int result = file_read(tf->fp, buffer, size);
-			lock_release(&filesys_lock);
+			int result = file_read(fp, buffer, size);
 			return result;
 		}
 	}
@@ -330,80 +387,129 @@ int write (int fd, void *buffer, unsigned size){
 		return size;
 	}
 	else{//write to a file
-		struct thread_file* tf = NULL;
-		/* start searching for a file with file descriptor number fd*/
-		struct list_elem *e;
-		for (e = list_begin(&thread_current()->opened_files); e != list_end (&thread_current()->opened_files); e = list_next (e))
-		{
-		  tf = list_entry (e, struct thread_file, elem);
-		  if(tf->fd == fd){
-			break;
-		  }
-		}
-
-		if(tf == NULL){
+		struct file *fp = fd_lookup(fd);
+		if(fp == NULL){
 			return -1;
 		}
 		else{
-			lock_acquire(&filesys_lock);
-			int result = file_write(tf->fp, buffer, size);
-			lock_release(&filesys_lock);
+			int result = file_write(fp, buffer, size);
 			return result;
 		}
 	}
 }
 
 void seek (int fd, unsigned position){
-	struct thread_file* tf = NULL;
-	/* start searching for a file with file descriptor number fd*/
-	struct list_elem *e;
-	for (e = list_begin(&thread_current()->opened_files); e != list_end (&thread_current()->opened_files); e = list_next (e))
-	{
-	  tf = list_entry (e, struct thread_file, elem);
-	  if(tf->fd == fd){
-		break;
-	  }
+	struct file *fp = fd_lookup(fd);
+	if(fp == NULL){
+		return;
 	}
-	lock_acquire(&filesys_lock);
-	file_seek(tf->fp, position);
-	lock_release(&filesys_lock);
+	file_seek(fp, position);
 }
 
 unsigned tell (int fd){
-	struct thread_file* tf = NULL;
-	/* start searching for a file with file descriptor number fd*/
-	struct list_elem *e;
-	for (e = list_begin(&thread_current()->opened_files); e != list_end (&thread_current()->opened_files); e = list_next (e))
-	{
-	  tf = list_entry (e, struct thread_file, elem);
-	  if(tf->fd == fd){
-		break;
-	  }
+	struct file *fp = fd_lookup(fd);
+	if(fp == NULL){
+		return -1;
 	}
-	lock_acquire(&filesys_lock);
-	int result = file_tell(tf->fp);
-	lock_release(&filesys_lock);
+	int result = file_tell(fp);
 	return result;
 }
 
 void close (int fd){
-	struct thread_file* tf = NULL;
-	/* start searching for a file with file descriptor number fd*/
+	struct file *fp = fd_lookup(fd);
+	if(fp == NULL){
+		return;
+	}
+	file_close(fp);
+	thread_current()->fd_table[fd] = NULL;
+	bitmap_reset(thread_current()->fd_map, fd);
+}
+
+#ifdef VM
+int mmap (int fd, void *addr){
+	struct thread *cur_thread = thread_current();
+
+	/* the mapping must start on a page boundary, and fds 0 and 1
+	 * (the console) can't be mapped */
+	if(addr == NULL || pg_ofs(addr) != 0 || fd < 2)
+		return -1;
+
+	struct file *mapped = fd_lookup(fd);
+	if(mapped == NULL)
+		return -1;
+
+	struct file *fp = file_reopen(mapped);
+	off_t length = fp != NULL ? file_length(fp) : 0;
+	if(fp != NULL && length == 0)
+		file_close(fp);
+	if(fp == NULL || length == 0)
+		return -1;
+
+	/* every page of the mapping must be unused user memory */
+	int page_cnt = (length + PGSIZE - 1) / PGSIZE;
+	int i;
+	for(i = 0; i < page_cnt; i++){
+		void *upage = (uint8_t *) addr + i * PGSIZE;
+		if(!is_user_vaddr(upage) || page_find(&cur_thread->supp_page_table, upage) != NULL){
+			file_close(fp);
+			return -1;
+		}
+	}
+
+	/* map the pages lazily: they are read in when first touched */
+	struct thread_mmap *m = malloc(sizeof(struct thread_mmap));
+	for(i = 0; m != NULL && i < page_cnt; i++){
+		void *upage = (uint8_t *) addr + i * PGSIZE;
+		off_t ofs = i * PGSIZE;
+		uint32_t read_bytes = length - ofs < PGSIZE ? length - ofs : PGSIZE;
+		if(!page_add(&cur_thread->supp_page_table, upage, INFILE, fp, ofs,
+				read_bytes, PGSIZE - read_bytes, true))
+			break;
+		page_find(&cur_thread->supp_page_table, upage)->mmapped = true;
+	}
+	if(m == NULL || i < page_cnt){
+		//out of memory: drop the pages added so far, none is loaded yet
+		while(i-- > 0)
+			page_unmap(&cur_thread->supp_page_table, (uint8_t *) addr + i * PGSIZE);
+		free(m);
+		file_close(fp);
+		return -1;
+	}
+
+	m->mapid = cur_thread->num_mapid++;
+	m->fp = fp;
+	m->addr = addr;
+	m->page_cnt = page_cnt;
+	list_push_back(&cur_thread->mmaps, &m->elem);
+	return m->mapid;
+}
+
+void munmap (int mapid){
 	struct list_elem *e;
-	for (e = list_begin(&thread_current()->opened_files); e != list_end (&thread_current()->opened_files); e = list_next (e))
+	for (e = list_begin(&thread_current()->mmaps); e != list_end (&thread_current()->mmaps); e = list_next (e))
 	{
-	  tf = list_entry (e, struct thread_file, elem);
-	  if(tf->fd == fd){
-		lock_acquire(&filesys_lock);
-		file_close(tf->fp);
-		lock_release(&filesys_lock);
+	  struct thread_mmap *m = list_entry (e, struct thread_mmap, elem);
+	  if(m->mapid == mapid){
+		/* write back what changed and drop the pages */
+		int i;
+		for(i = 0; i < m->page_cnt; i++)
+			page_unmap(&thread_current()->supp_page_table, (uint8_t *) m->addr + i * PGSIZE);
+		file_close(m->fp);
 		list_remove(e);
-		free(tf);
+		free(m);
 		return;
 	  }
 	}
 }
 
+/* unmaps every mapping of the current process, at exit */
+void munmap_all (void){
+	struct list *mmaps = &thread_current()->mmaps;
+	while(!list_empty(mmaps))
+		munmap(list_entry(list_front(mmaps), struct thread_mmap, elem)->mapid);
+}
+#endif
+
 void check_addr_pin(const void *addr, bool unpin){
 	if(addr == NULL){
 		exit(-1);
@@ -424,28 +530,53 @@ void check_addr(const void *addr) {
 	check_addr_pin(addr,true);
 }
 
+/* validates and pins the SIZE bytes at ADDR. Every byte of a page is
+ * as good as any other, so this costs one check per page touched, not
+ * one per byte */
 void check_addr_buffer(const void* addr, int size, bool writing){
-    for(int i = size - 1; i >= 0; i--){
-        check_addr_pin(addr + i,false);
+    const uint8_t *first = addr;
+    const uint8_t *last = first + size - 1;
+    const uint8_t *page;
+
+    if(size <= 0)
+        return;
+    if(last < first) //wraps around the address space
+        exit(-1);
+
+    for(page = pg_round_down(last); ; page -= PGSIZE){
+        const uint8_t *p = page < first ? first : page;
+        check_addr_pin(p,false);
 #ifdef VM
-        struct supp_page_table_entry *spte = page_find(&thread_current()->supp_page_table,addr+i);
+        struct supp_page_table_entry *spte = page_find(&thread_current()->supp_page_table,p);
         if (spte && writing && !spte->writable)
             exit(-1);
 #endif
+        if(page <= first)
+            break;
     }
 }
 
+/* validates and pins a null-terminated string, checking each page
+ * once as the walk reaches it */
 void check_addr_string(const char* str){
     check_addr_pin(str,false);
     while(*str != 0){
-        check_addr(++str);
+        if(pg_ofs(++str) == 0)
+            check_addr_pin(str,false);
     }
 }
 
 void unpin_all_buffer(const void *addr, int size) {
 #ifdef VM
-    for(int i = size - 1; i >= 0; i--){
-        page_unpin(&thread_current()->supp_page_table,addr+1);
+    const uint8_t *first = addr;
+    const uint8_t *page;
+
+    if(size <= 0)
+        return;
+    for(page = pg_round_down(first + size - 1); ; page -= PGSIZE){
+        page_unpin(&thread_current()->supp_page_table,page < first ? first : page);
+        if(page <= first)
+            break;
     }
 #endif
 }
@@ -454,7 +585,8 @@ void unpin_all_string(const char *str) {
 #ifdef VM
     page_unpin(&thread_current()->supp_page_table,str);
     while(*str != 0){
-        page_unpin(&thread_current()->supp_page_table,++str);
+        if(pg_ofs(++str) == 0)
+            page_unpin(&thread_current()->supp_page_table,str);
     }
 #endif
 }
@@ -7,15 +7,20 @@ void syscall_init (void);
 
 #ifdef USERPROG
 void exit (int status);
+void fd_close_all (void);
 #endif
 
-//this struct is used for storing info about files opened in a thread
-struct thread_file{
-	struct file* fp;
-	int fd;
+#ifdef VM
+//this struct is used for storing info about files memory mapped in a thread
+struct thread_mmap{
+	int mapid;
+	struct file* fp;/* own reopened file, so closing the fd keeps the mapping */
+	void* addr;
+	int page_cnt;
 	struct list_elem elem;
 };
 
-struct lock filesys_lock;
+void munmap_all (void);
+#endif
 
 #endif /* userprog/syscall.h */
@@ -1,104 +1,509 @@
 #include "vm/frame.h"
+#include <stdio.h>
+#include "devices/timer.h"
 #include "filesys/file.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
+#include "threads/vaddr.h"
 #include "userprog/pagedir.h"
 #include "userprog/syscall.h"
 #include "vm/swap.h"
 #include "vm/page.h"
 
+/* The frame table, one entry per user frame, indexed by
+ * (frame - frame_base) / PGSIZE. */
+static struct frame_table_entry *frame_table;
+static size_t frame_cnt;
+static uint8_t *frame_base; /* kernel address of the first user frame */
 
-enum palloc_flags flags;
+static struct list free_frames;
+static struct lock frame_table_lock;
+
+/* read-only file pages mapped by several processes, keyed by
+ * (inode, ofs, read_bytes). Protected by frame_table_lock */
+static struct hash shared_frames;
+static struct condition share_loaded; /* a shared frame finished loading */
+static struct condition frame_written; /* an evicted mmap frame reached its file */
+
+/* WSClock state: the hand persists across evictions */
+static size_t clock_hand;
+int64_t frame_age_window = FRAME_AGE_WINDOW_DEFAULT;
+
+/* how many times frame_alloc retries eviction while every frame is pinned */
+#define EVICT_RETRIES 64
+
+/* most pages written to swap per eviction round; extra victims are
+ * only taken from outside the working set */
+#define EVICT_CLUSTER 4
+
+/* most frames the clock hand moves on past the first victim looking
+ * for extra ones, so that one eviction doesn't age the whole table */
+#define EVICT_CLUSTER_SCAN 16
+
+/* eviction statistics */
+static unsigned long long evict_cnt; /* frames evicted */
+static unsigned long long discard_cnt; /* evicted frames dropped without swap */
+static unsigned long long writeback_cnt; /* evicted mmap frames written to their file */
+static unsigned long long scan_cnt; /* frames examined by the clock hand */
+static unsigned long long share_hits; /* faults served by an already shared frame */
+
+static struct frame_table_entry *frame_to_fte (void *frame);
+static struct frame_table_entry *frame_get (struct supp_page_table_entry *spte);
+static unsigned share_hash_func (const struct hash_elem *e, void *aux);
+static bool share_less_func (const struct hash_elem *a, const struct hash_elem *b, void *aux);
 
 void frame_init (void){
 	void* page = NULL;
-	list_init(&frame_table);
+	size_t i;
+
 	list_init(&free_frames);
 	lock_init(&frame_table_lock);
+	hash_init(&shared_frames, share_hash_func, share_less_func, NULL);
+	cond_init(&share_loaded);
+	cond_init(&frame_written);
+
+	/* grab every user frame; palloc hands them out in address order */
 	while ((page = palloc_get_page(PAL_USER)) != NULL) {
-		struct frame_table_entry *fte = malloc(sizeof(struct frame_table_entry));
-		fte->frame = page;
-		fte->clock_dirty = 1;
+		if (frame_cnt == 0)
+			frame_base = page;
+		ASSERT((uint8_t *) page == frame_base + frame_cnt * PGSIZE);
+		frame_cnt++;
+	}
+
+	frame_table = malloc(frame_cnt * sizeof *frame_table);
+	if (frame_table == NULL && frame_cnt > 0)
+		PANIC("Cannot allocate frame table");
+	for (i = 0; i < frame_cnt; i++) {
+		struct frame_table_entry *fte = &frame_table[i];
+		fte->frame = frame_base + i * PGSIZE;
+		list_init(&fte->sharers);
+		fte->share_cnt = 0;
+		fte->inode = NULL;
+		fte->loading = false;
+		fte->last_used = 0;
 		list_push_back(&free_frames,&fte->elem);
 	}
 }
+
 void* frame_alloc (struct supp_page_table_entry *spte){
 	lock_acquire(&frame_table_lock);
+	struct frame_table_entry *fte = frame_get(spte);
+	lock_release(&frame_table_lock);
+
+	return fte != NULL ? fte->frame : NULL;
+}
+
+/* returns true if SPTE's page is read-only text that other processes
+ * running the same executable can map from the same frame */
+bool frame_is_shareable (const struct supp_page_table_entry *spte){
+	return spte->file != NULL && !spte->writable;
+}
+
+/* returns the shared frame holding SPTE's file page, mapping count
+ * raised for SPTE. If no process has the page in memory, a new frame
+ * is registered for it and *FRESH is set: the caller must read the
+ * page in and then call frame_share_done(). A frame somebody else is
+ * still reading is waited for. Returns NULL if no frame is available */
+void* frame_share (struct supp_page_table_entry *spte, bool *fresh){
+	struct frame_table_entry key, *fte;
+	struct hash_elem *e;
+
+	ASSERT (frame_is_shareable(spte));
+	key.inode = file_get_inode(spte->file);
+	key.ofs = spte->ofs;
+	key.read_bytes = spte->read_bytes;
+
+	lock_acquire(&frame_table_lock);
+	for (;;) {
+		while ((e = hash_find(&shared_frames, &key.share_elem)) != NULL) {
+			fte = hash_entry(e, struct frame_table_entry, share_elem);
+			if (!fte->loading) {
+				list_push_back(&fte->sharers, &spte->share_elem);
+				fte->share_cnt++;
+				fte->last_used = timer_ticks();
+				share_hits++;
+				lock_release(&frame_table_lock);
+				*fresh = false;
+				return fte->frame;
+			}
+			cond_wait(&share_loaded, &frame_table_lock);
+		}
+
+		fte = frame_get(spte);
+		if (fte == NULL)
+			break;
+		fte->inode = key.inode;
+		fte->ofs = key.ofs;
+		fte->read_bytes = key.read_bytes;
+		if (hash_insert(&shared_frames, &fte->share_elem) == NULL) {
+			fte->loading = true;
+			break;
+		}
+
+		/* frame_get dropped the lock to evict and somebody else
+		 * registered the page meanwhile: give the frame back and
+		 * share theirs */
+		list_remove(&spte->share_elem);
+		fte->share_cnt = 0;
+		fte->inode = NULL;
+		list_push_back(&free_frames, &fte->elem);
+	}
+	lock_release(&frame_table_lock);
+
+	*fresh = true;
+	return fte != NULL ? fte->frame : NULL;
+}
+
+/* finishes loading shared FRAME, obtained fresh from frame_share().
+ * If the read failed (OK false) the frame is withdrawn from sharing
+ * so that waiters try again; the caller still frees it */
+void frame_share_done (void *frame, bool ok){
+	lock_acquire(&frame_table_lock);
+	struct frame_table_entry *fte = frame_to_fte(frame);
+	ASSERT (fte != NULL && fte->loading);
+	fte->loading = false;
+	if (!ok) {
+		hash_delete(&shared_frames, &fte->share_elem);
+		fte->inode = NULL;
+	}
+	cond_broadcast(&share_loaded, &frame_table_lock);
+	lock_release(&frame_table_lock);
+}
+
+/* takes a free frame, evicting one if necessary, and hands it to SPTE.
+ * If every frame is pinned, lets their loaders finish and tries again,
+ * up to a limit, then returns NULL. Must be called with
+ * frame_table_lock held, which may be dropped and retaken. */
+static struct frame_table_entry *frame_get (struct supp_page_table_entry *spte){
+	int tries = 0;
 
-	/* if no frames available, evict frame */
-	if(list_empty(&free_frames)) {
-		frame_evict();
+	while(list_empty(&free_frames)) {
+		if(frame_evict())
+			break;
+		if(++tries > EVICT_RETRIES)
+			return NULL;
+		lock_release(&frame_table_lock);
+		thread_yield();
+		lock_acquire(&frame_table_lock);
 	}
 
 	/* when frame available, get from frame list */
 	struct list_elem *elem = list_pop_front(&free_frames);
 	struct frame_table_entry *fte = list_entry(elem, struct frame_table_entry, elem);
-	list_remove(elem);
 
-	/* add the frame to the frame table */
-	fte->spte = spte;
-	fte->clock_dirty = 1;
-	list_push_back(&frame_table, &fte->elem);
-	lock_release(&frame_table_lock);
+	/* hand the frame to SPTE */
+	list_push_back(&fte->sharers, &spte->share_elem);
+	fte->share_cnt = 1;
+	fte->last_used = timer_ticks();
+	return fte;
+}
 
-	return fte->frame;
+/* returns true if a page of FTE is pinned in any of its mappers */
+static bool frame_is_pinned (struct frame_table_entry *fte){
+	struct list_elem *e;
+	for (e = list_begin(&fte->sharers); e != list_end(&fte->sharers); e = list_next(e))
+		if (list_entry(e, struct supp_page_table_entry, share_elem)->pin)
+			return true;
+	return false;
 }
 
-struct frame_table_entry* clock_eviction(){
-	struct list_elem* clock_state_elem = list_begin(&frame_table);
-	while(clock_state_elem != list_end(&frame_table)){
-		struct frame_table_entry *fte = list_entry(clock_state_elem, struct frame_table_entry, elem);
-		//if it's a dirty page on the first clock cycle, give it a 'second chance'
-		if(!fte->spte->pin) {
-		if(pagedir_is_dirty(fte->spte->owner->pagedir, fte->spte->upage) && fte->clock_dirty == 1){
-			fte->clock_dirty = 0;
-		}
-		//if not dirty, select current page to be evicted if it hasn't been accessed
-		else if(!pagedir_is_accessed(fte->spte->owner->pagedir, fte->spte->upage)){
-			return fte;
-		}
-		//otherwise,set accessed bit to 0
-		else{
-			pagedir_set_accessed(fte->spte->owner->pagedir, fte->spte->upage,false);
-		}
+/* returns true if any mapper referenced FTE since the last call, and
+ * clears the accessed bits */
+static bool frame_test_and_clear_accessed (struct frame_table_entry *fte){
+	struct list_elem *e;
+	bool accessed = false;
+	for (e = list_begin(&fte->sharers); e != list_end(&fte->sharers); e = list_next(e)) {
+		struct supp_page_table_entry *spte = list_entry(e, struct supp_page_table_entry, share_elem);
+		if (pagedir_is_accessed(spte->owner->pagedir, spte->upage)) {
+			pagedir_set_accessed(spte->owner->pagedir, spte->upage, false);
+			accessed = true;
 		}
-		//circle back to the beginning of the list if we reach the end
-		clock_state_elem = list_next(clock_state_elem);
-		if(clock_state_elem == list_end(&frame_table)){
-			clock_state_elem = list_begin(&frame_table);
+	}
+	return accessed;
+}
+
+/* returns true if any mapper has written to FTE */
+static bool frame_is_dirty (struct frame_table_entry *fte){
+	struct list_elem *e;
+	for (e = list_begin(&fte->sharers); e != list_end(&fte->sharers); e = list_next(e)) {
+		struct supp_page_table_entry *spte = list_entry(e, struct supp_page_table_entry, share_elem);
+		if (pagedir_is_dirty(spte->owner->pagedir, spte->upage))
+			return true;
+	}
+	return false;
+}
+
+/* WSClock: sweep from the persistent hand, clearing accessed bits
+ * and stamping referenced frames with the current time. The first
+ * unreferenced, clean frame older than the aging window is chosen.
+ * Old dirty frames are remembered and used only if no clean one
+ * turns up, and if nothing is old enough the least recently used
+ * unpinned frame is taken. If OLD_ONLY, the first old frame is taken
+ * whether dirty or not, and nothing else. At most *BUDGET frames are
+ * examined, and *BUDGET is reduced by the number examined. Returns
+ * NULL if every frame is pinned, or, if OLD_ONLY, when no old frame
+ * turns up within the budget. */
+static struct frame_table_entry* wsclock_select(size_t *budget, bool old_only){
+	int64_t now = timer_ticks();
+	struct frame_table_entry *dirty_victim = NULL;
+	struct frame_table_entry *oldest = NULL;
+
+	while(*budget > 0){
+		struct frame_table_entry *fte = &frame_table[clock_hand];
+		clock_hand = (clock_hand + 1) % frame_cnt;
+		(*budget)--;
+		scan_cnt++;
+
+		if(fte->share_cnt == 0 || frame_is_pinned(fte))
+			continue;
+
+		//referenced since the last sweep: still in the working set
+		if(frame_test_and_clear_accessed(fte)){
+			fte->last_used = now;
+			continue;
 		}
+		if(oldest == NULL || fte->last_used < oldest->last_used)
+			oldest = fte;
+		if(now - fte->last_used <= frame_age_window)
+			continue;
+		if(old_only || !frame_is_dirty(fte))
+			return fte;
+		if(dirty_victim == NULL)
+			dirty_victim = fte;
 	}
+	if(dirty_victim != NULL || old_only)
+		return dirty_victim;
+	return oldest;
 }
 
-void frame_evict (void){
-    struct frame_table_entry *entry = clock_eviction();
-    void* page = pagedir_get_page(entry->spte->owner->pagedir, entry->spte->upage);
-    pagedir_clear_page(entry->spte->owner->pagedir, entry->spte->upage);
-    int idx = swap_out(page);
-    entry->spte->swap_table_idx = idx;
-    entry->spte->status = INSWAP;
+/* evicts a frame onto the free list, unmapping it from every process
+ * that shares it. A victim that has to go to swap is batched with up
+ * to EVICT_CLUSTER - 1 more old frames so their pages land in adjacent
+ * swap slots in one go. The extra victims come from the frames just
+ * past the first one, at most EVICT_CLUSTER_SCAN of them and never
+ * more than the rest of the hand's two revolutions. Returns false if
+ * every frame is pinned. Must be called with frame_table_lock held,
+ * which is dropped while a mapped page is written back to its file. */
+bool frame_evict (void){
+    size_t budget = 2 * frame_cnt;
+    struct frame_table_entry *entry = wsclock_select(&budget, false);
+    struct frame_table_entry *written = NULL;
+    struct supp_page_table_entry *written_spte = NULL;
+    struct frame_table_entry *victims[EVICT_CLUSTER];
+    struct supp_page_table_entry *sptes[EVICT_CLUSTER];
+    void *frames[EVICT_CLUSTER];
+    int slots[EVICT_CLUSTER];
+    size_t swap_cnt = 0, i;
+
+    if (entry == NULL)
+        return false;
+    if (budget > EVICT_CLUSTER_SCAN)
+        budget = EVICT_CLUSTER_SCAN;
 
-    list_remove(&entry->elem);
-    entry->spte = NULL;
-    list_push_back(&free_frames,&entry->elem);
+    while (entry != NULL) {
+        struct supp_page_table_entry *spte = list_entry(list_front(&entry->sharers),
+                struct supp_page_table_entry, share_elem);
+        bool dirty = frame_is_dirty(entry);
+        bool to_swap = (spte->file == NULL || dirty) && !spte->mmapped;
+
+        /* extra victims only join the swap cluster: other old frames
+         * are left for a later round */
+        if (swap_cnt > 0 && !to_swap) {
+            entry = wsclock_select(&budget, true);
+            continue;
+        }
+        evict_cnt++;
+
+        if (spte->file != NULL && !dirty) {
+            /* still identical to its file contents (always true of read-only
+             * text): drop it from every mapper, load_page will read it back
+             * from the file */
+            discard_cnt++;
+            while (!list_empty(&entry->sharers)) {
+                spte = list_entry(list_pop_front(&entry->sharers),
+                        struct supp_page_table_entry, share_elem);
+                pagedir_clear_page(spte->owner->pagedir, spte->upage);
+                spte->status = INFILE;
+            }
+            if (entry->inode != NULL) {
+                hash_delete(&shared_frames, &entry->share_elem);
+                entry->inode = NULL;
+            }
+            entry->share_cnt = 0;
+            list_push_back(&free_frames,&entry->elem);
+        } else if (spte->mmapped) {
+            /* a mapped file is its own backing store: write the page
+             * back instead of swapping it, below. Until then the frame
+             * looks free to the clock hand but isn't on the free list,
+             * and the page is INWRITEBACK, which load_page and
+             * frame_unmap wait out */
+            ASSERT (entry->share_cnt == 1 && entry->inode == NULL);
+            pagedir_clear_page(spte->owner->pagedir, spte->upage);
+            spte->status = INWRITEBACK;
+            written = entry;
+            written_spte = spte;
+            writeback_cnt++;
+            list_init(&entry->sharers);
+            entry->share_cnt = 0;
+        } else {
+            /* only private frames can be dirty */
+            ASSERT (entry->share_cnt == 1 && entry->inode == NULL);
+            pagedir_clear_page(spte->owner->pagedir, spte->upage);
+            victims[swap_cnt] = entry;
+            sptes[swap_cnt] = spte;
+            frames[swap_cnt] = entry->frame;
+            swap_cnt++;
+
+            /* looks free to the clock hand until it is on the free list,
+             * so it can't be picked twice */
+            list_init(&entry->sharers);
+            entry->share_cnt = 0;
+        }
+
+        /* a discard or write-back is one page; a swap-out is worth
+         * batching with more pages nobody has used lately */
+        if (!to_swap || swap_cnt == EVICT_CLUSTER)
+            break;
+        entry = wsclock_select(&budget, true);
+    }
+
+    if (written != NULL) {
+        /* file_write_at takes inode and cache locks, which must not
+         * be acquired while holding frame_table_lock */
+        lock_release(&frame_table_lock);
+        file_write_at(written_spte->file, written->frame,
+                written_spte->read_bytes, written_spte->ofs);
+        lock_acquire(&frame_table_lock);
+        written_spte->status = INFILE;
+        list_push_back(&free_frames,&written->elem);
+        cond_broadcast(&frame_written, &frame_table_lock);
+    }
+    if (swap_cnt == 0)
+        return true;
+
+    swap_out_cluster(frames, slots, swap_cnt);
+    for (i = 0; i < swap_cnt; i++) {
+        sptes[i]->swap_table_idx = slots[i];
+        sptes[i]->status = INSWAP;
+        /* from now on the page lives in swap; its contents may no longer
+         * match the file even once it is clean again after swap_in */
+        sptes[i]->file = NULL;
+        list_push_back(&free_frames,&victims[i]->elem);
+    }
+    return true;
 }
 
-void frame_free (void *frame){
+/* drops SPTE's mapping of FRAME. The frame goes back on the free list
+ * once nobody maps it any more. Does nothing if SPTE no longer maps
+ * FRAME, e.g. because it was evicted meanwhile. */
+void frame_free (void *frame, struct supp_page_table_entry *spte){
+	struct list_elem *e;
+
 	lock_acquire(&frame_table_lock);
 
-	struct list_elem *e;
-	for(e = list_begin(&frame_table); e != list_end(&frame_table); e = list_next(e)){
-		struct frame_table_entry *fte = list_entry(e, struct frame_table_entry, elem);
-		if(fte->frame == frame){
+	struct frame_table_entry *fte = frame_to_fte(frame);
+	if (fte != NULL) {
+		for (e = list_begin(&fte->sharers); e != list_end(&fte->sharers); e = list_next(e))
+			if (e == &spte->share_elem)
+				break;
+		if (e != list_end(&fte->sharers)) {
 			list_remove(e);
-			fte->spte = NULL;
-			list_push_back(&free_frames,&fte->elem);
-			break;
+			if (--fte->share_cnt == 0) {
+				if (fte->inode != NULL) {
+					hash_delete(&shared_frames, &fte->share_elem);
+					fte->inode = NULL;
+				}
+				list_push_back(&free_frames,&fte->elem);
+			}
 		}
 	}
 	lock_release(&frame_table_lock);
 }
 
+/* waits while frame_evict writes memory mapped page SPTE back to its
+ * file. Must be called with frame_table_lock held */
+static void wait_writeback (struct supp_page_table_entry *spte){
+	while (spte->status == INWRITEBACK)
+		cond_wait(&frame_written, &frame_table_lock);
+}
+
+/* waits until SPTE's page is not being written back by frame_evict.
+ * Once SPTE is pinned it can't start again */
+void frame_wait_writeback (struct supp_page_table_entry *spte){
+	lock_acquire(&frame_table_lock);
+	wait_writeback(spte);
+	lock_release(&frame_table_lock);
+}
+
+/* drops the frame of memory mapped page SPTE, which must be INFRAME
+ * or INWRITEBACK, writing the page back to its file first if it was
+ * modified. If an eviction is already writing the page back, waits
+ * for it instead.
+ * Must be called with SPTE's load_lock held and SPTE pinned, so that
+ * nothing else maps or evicts the page meanwhile. */
+void frame_unmap (struct supp_page_table_entry *spte){
+	uint32_t *pd = spte->owner->pagedir;
+	struct frame_table_entry *fte;
+	bool dirty;
+
+	ASSERT (spte->mmapped && spte->pin);
+
+	lock_acquire(&frame_table_lock);
+	wait_writeback(spte);
+	if (spte->status != INFRAME) {
+		lock_release(&frame_table_lock);
+		return;
+	}
+
+	/* detach the frame so the clock hand passes over it */
+	fte = frame_to_fte(pagedir_get_page(pd, spte->upage));
+	ASSERT (fte != NULL && fte->share_cnt == 1 && fte->inode == NULL);
+	dirty = pagedir_is_dirty(pd, spte->upage);
+	pagedir_clear_page(pd, spte->upage);
+	list_remove(&spte->share_elem);
+	fte->share_cnt = 0;
+	lock_release(&frame_table_lock);
+
+	if (dirty)
+		file_write_at(spte->file, fte->frame, spte->read_bytes, spte->ofs);
+	spte->status = INFILE;
+
+	lock_acquire(&frame_table_lock);
+	list_push_back(&free_frames,&fte->elem);
+	lock_release(&frame_table_lock);
+}
+
+/* Returns the frame table entry for kernel address FRAME, or NULL
+ * if FRAME is not a user frame. Constant time. */
+static struct frame_table_entry *frame_to_fte (void *frame){
+	uint8_t *kpage = pg_round_down(frame);
+	if (kpage < frame_base || kpage >= frame_base + frame_cnt * PGSIZE)
+		return NULL;
+	return &frame_table[(kpage - frame_base) / PGSIZE];
+}
 
+/* Shared frame hash functions */
+static unsigned share_hash_func (const struct hash_elem *e, void *aux UNUSED){
+	const struct frame_table_entry *fte = hash_entry(e, struct frame_table_entry, share_elem);
+	return hash_int((int) fte->inode ^ fte->ofs);
+}
+
+static bool share_less_func (const struct hash_elem *a_, const struct hash_elem *b_, void *aux UNUSED){
+	const struct frame_table_entry *a = hash_entry(a_, struct frame_table_entry, share_elem);
+	const struct frame_table_entry *b = hash_entry(b_, struct frame_table_entry, share_elem);
+	if (a->inode != b->inode)
+		return a->inode < b->inode;
+	if (a->ofs != b->ofs)
+		return a->ofs < b->ofs;
+	return a->read_bytes < b->read_bytes;
+}
+
+/* prints eviction statistics */
+void frame_print_stats (void){
+	printf("Frame: %llu evictions (%llu discarded, %llu written back), "
+			"%llu frames scanned (%llu per eviction), %llu shared page hits\n",
+			evict_cnt, discard_cnt, writeback_cnt, scan_cnt,
+			evict_cnt ? scan_cnt / evict_cnt : 0, share_hits);
+}
@@ -1,25 +1,45 @@
 #ifndef VM_FRAME_H
 #define VM_FRAME_H
 
+#include <hash.h>
 #include <list.h>
+#include "filesys/off_t.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 
-struct list free_frames;
-struct list frame_table;
-struct lock frame_table_lock;
+/* default WSClock aging window, in timer ticks: an unreferenced frame
+ * last used longer ago than this is outside the working set */
+#define FRAME_AGE_WINDOW_DEFAULT 50
+
+struct supp_page_table_entry;
 
 struct frame_table_entry {
 	void * frame; /* which frame does this entry represent */
-	struct supp_page_table_entry * spte; /* what page this frame corresponds to */
-	struct list_elem elem;
-	int clock_dirty; /*dirty bit for clock eviction alg*/
+	struct list sharers; /* pages mapped to this frame, empty if free */
+	int share_cnt; /* number of pages in sharers */
+	struct list_elem elem; /* element in free_frames while free */
+	int64_t last_used; /* tick the clock hand last saw this frame referenced */
+
+	/* read-only file page shared between processes, inode NULL if private */
+	struct inode *inode;
+	off_t ofs;
+	uint32_t read_bytes;
+	bool loading; /* still being read in by the first sharer */
+	struct hash_elem share_elem; /* element in shared_frames */
 };
 
+/* WSClock aging window, set by the -age kernel option */
+extern int64_t frame_age_window;
+
 void frame_init (void);
 void* frame_alloc (struct supp_page_table_entry *spte);
-void frame_free (void *frame);
-//void frame_add_to_table (void *frame, struct page *spte);
-void frame_evict (void);
+void frame_free (void *frame, struct supp_page_table_entry *spte);
+void frame_unmap (struct supp_page_table_entry *spte);
+void frame_wait_writeback (struct supp_page_table_entry *spte);
+bool frame_is_shareable (const struct supp_page_table_entry *spte);
+void* frame_share (struct supp_page_table_entry *spte, bool *fresh);
+void frame_share_done (void *frame, bool ok);
+bool frame_evict (void);
+void frame_print_stats (void);
 
 #endif /* vm/frame.h */
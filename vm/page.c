@@ -29,12 +29,15 @@ bool page_add (struct hash *spt, void *upage, int status,
 	struct file *file, off_t ofs, uint32_t read_bytes,
 	uint32_t zero_bytes, bool writable) {
 	struct supp_page_table_entry *spte = (struct supp_page_table_entry *) malloc(sizeof(struct supp_page_table_entry));
+	if (spte == NULL)
+		return false;
 	spte->owner = thread_current();
 	spte->upage = upage;
 	spte->swap_table_idx = -1;
 	spte->status = status;
 	spte->writable = writable;
 	spte->pin = false;
+	spte->mmapped = false;
 	lock_init(&spte->load_lock);
 
 	spte->file = file;
@@ -69,25 +72,41 @@ bool page_map_to_frame(void* addr, void* sp, bool unpin){
 bool load_page (struct supp_page_table_entry *spte){
 	lock_acquire(&spte->load_lock);
 	spte->pin = true;
+	//an evicted mmap page is unmapped before it is written back
+	frame_wait_writeback(spte);
 	if(spte->status == INFRAME) {
 		lock_release(&spte->load_lock);
 		return true;
 	}
-	void *kpage = frame_alloc(spte);
+	void *kpage;
+	bool fresh = true;
+	if(spte->status == INFILE && frame_is_shareable(spte))
+		kpage = frame_share(spte, &fresh);
+	else
+		kpage = frame_alloc(spte);
 	if(kpage == NULL) {
 		spte->pin = false;
 		lock_release(&spte->load_lock);
 		return false;
 	}
 	if(spte->status == INFILE) {
-		/* Load this page. */
-		file_seek(spte->file,spte->ofs);
-		if (file_read (spte->file, kpage, spte->read_bytes) != (int) spte->read_bytes) {
-			frame_free (kpage);
-			lock_release(&spte->load_lock);
-			return false;
+		/* Load this page, unless another process running the same
+		 * executable already has. This also runs again after the frame
+		 * was discarded by frame_evict, so don't disturb the file
+		 * position. */
+		if (fresh) {
+			bool ok = file_read_at (spte->file, kpage, spte->read_bytes, spte->ofs) == (int) spte->read_bytes;
+			if (ok)
+				memset (kpage + spte->read_bytes, 0, spte->zero_bytes);
+			if (frame_is_shareable(spte))
+				frame_share_done (kpage, ok);
+			if (!ok) {
+				frame_free (kpage, spte);
+				spte->pin = false;
+				lock_release(&spte->load_lock);
+				return false;
+			}
 		}
-		memset (kpage + spte->read_bytes, 0, spte->zero_bytes);
 	} else if (spte->status == INSTACK) {
 		memset (kpage, 0, spte->zero_bytes);
 	} else if (spte->status == INSWAP) {
@@ -97,7 +116,7 @@ bool load_page (struct supp_page_table_entry *spte){
 	
 	/* Add the page to the process's address space. */
 	if (!install_page (spte->upage, kpage, spte->writable)) {
-		frame_free (kpage);
+		frame_free (kpage, spte);
 		spte->pin = false;
 		lock_release(&spte->load_lock);
 		return false;
@@ -134,6 +153,23 @@ void page_unpin(struct hash *spt, void *upage) {
 	lock_release(&spte->load_lock);
 }
 
+/* removes a memory mapped page from SPT, writing it back to its file
+ * first if it was modified while in memory */
+void page_unmap (struct hash *spt, void *upage) {
+	struct supp_page_table_entry *spte = page_find(spt, upage);
+	if (spte == NULL) return;
+
+	lock_acquire(&spte->load_lock);
+	/* keep the evictor off the frame while we write it back */
+	spte->pin = true;
+	if (spte->status == INFRAME || spte->status == INWRITEBACK)
+		frame_unmap(spte);
+	lock_release(&spte->load_lock);
+
+	hash_delete(spt, &spte->elem);
+	free(spte);
+}
+
 /* Hash Functions */
 unsigned spte_hash_func(const struct hash_elem *elem, void *aux UNUSED) {
   struct supp_page_table_entry *entry = hash_entry(elem, struct supp_page_table_entry, elem);
@@ -149,7 +185,7 @@ bool spte_less_func(const struct hash_elem *a, const struct hash_elem *b, void *
 void spte_destroy_func(struct hash_elem *elem, void *aux UNUSED) {
   struct supp_page_table_entry *spte = hash_entry(elem, struct supp_page_table_entry, elem);
   if (spte->status == INFRAME){
-	  frame_free(pagedir_get_page(thread_current()->pagedir, spte->upage));
+	  frame_free(pagedir_get_page(thread_current()->pagedir, spte->upage), spte);
 	  pagedir_clear_page(thread_current()->pagedir, spte->upage);
   }
   else if (spte->status == INSWAP){
@@ -9,6 +9,7 @@
 #define INFRAME 2
 #define INFILE 3
 #define INSTACK 4
+#define INWRITEBACK 5 //evicted mmap page still being written to its file
 #define STACK_THRESH 32
 //8MB
 #define MAX_STACK_SIZE 0x800000 
@@ -20,6 +21,7 @@ struct supp_page_table_entry {
 	int swap_table_idx;
 	bool pin;
 	bool writable;
+	bool mmapped; /* memory mapped: written back to FILE, never swapped */
 
 	// file info
 	struct file *file;
@@ -28,6 +30,7 @@ struct supp_page_table_entry {
 	uint32_t zero_bytes;
 
 	struct hash_elem elem;
+	struct list_elem share_elem; /* element in its frame's sharers list */
 	struct lock load_lock;
 };
 
@@ -37,6 +40,7 @@ bool page_map_to_frame(void* addr, void* sp, bool unpin);
 bool load_page (struct supp_page_table_entry *spte);
 bool grow_stack (struct hash *spt, void *va, bool unpin);
 void page_unpin(struct hash *spt, void* upage);
+void page_unmap (struct hash *spt, void *upage);
 
 bool page_add (struct hash *spt, void *upage, int status, 
 	struct file *file, off_t ofs, uint32_t read_bytes,
@@ -20,28 +20,53 @@ void init_swap_table (void){
 	bitmap_set_all (swap_table, SLOT_FREE);
 }
 
-/* swap a page out of VM into swap space*/
-int swap_out (void * frame){
+/* swap CNT pages out of VM into swap space, storing the slot of
+ * FRAMES[i] in IDX[i] (-1 if there is no swap device). The pages go
+ * to adjacent slots when a run of CNT free slots exists, so the disk
+ * sees one sequential stream; each page is a single block request,
+ * and all of them are queued before waiting for any */
+void swap_out_cluster (void **frames, int *idx, size_t cnt){
+	struct block_request reqs[cnt];
+	size_t i;
+
 	if (!swap_device || !swap_table){
-		return -1;
+		for(i = 0; i < cnt; i++)
+			idx[i] = -1;
+		return;
 	}
 	lock_acquire(&swap_lock);
 
-	/* get a free slot from swap table (and flip the corresponding bit */
-	int free_slot_idx = bitmap_scan_and_flip(swap_table, 0, 1, SLOT_FREE);
+	/* get adjacent free slots from swap table (and flip the bits),
+	 * or scattered ones if the swap space is too fragmented */
+	size_t first = bitmap_scan_and_flip_next(swap_table, cnt, SLOT_FREE);
+	for(i = 0; i < cnt; i++){
+		size_t slot = first;
+		if (first == BITMAP_ERROR)
+			slot = bitmap_scan_and_flip_next(swap_table, 1, SLOT_FREE);
+		else
+			slot += i;
 
-	/* check for error */
-	if (free_slot_idx == BITMAP_ERROR) PANIC("Swap partition is full!");
+		/* check for error */
+		if (slot == BITMAP_ERROR) PANIC("Swap partition is full!");
 
-	/* write the frame */
-	int i;
-	for(i = 0; i < SECTORS_PER_PAGE; i++){
-	      block_write (swap_device, free_slot_idx * SECTORS_PER_PAGE + i, (uint8_t *) frame + i * BLOCK_SECTOR_SIZE);
+		/* queue the write of the frame */
+		block_request_init (&reqs[i], true, slot * SECTORS_PER_PAGE, SECTORS_PER_PAGE, frames[i], NULL, NULL);
+		block_submit (swap_device, &reqs[i]);
+		idx[i] = slot;
 	}
 
+	/* the pages must be on disk before their frames are reused */
+	for(i = 0; i < cnt; i++)
+		block_wait (&reqs[i]);
+
 	lock_release(&swap_lock);
+}
 
-	return free_slot_idx;
+/* swap a page out of VM into swap space*/
+int swap_out (void * frame){
+	int idx;
+	swap_out_cluster(&frame, &idx, 1);
+	return idx;
 }
 
 /* swap a page into VM from swap space*/
@@ -51,11 +76,8 @@ void swap_in (int idx, void *frame){
 	}
 	lock_acquire(&swap_lock);
 
-	/* read the content back to VM*/
-	int i;
-	for(i = 0; i < SECTORS_PER_PAGE; i++){
-		block_read (swap_device, idx * SECTORS_PER_PAGE + i, (uint8_t *) frame + i * BLOCK_SECTOR_SIZE);
-	}
+	/* read the content back to VM in one command */
+	block_read_multiple (swap_device, idx * SECTORS_PER_PAGE, SECTORS_PER_PAGE, frame);
 
 	/* mark the slot free */
 	bitmap_flip(swap_table, idx);
@@ -65,5 +87,9 @@ void swap_in (int idx, void *frame){
 
 /* clears the swap slot */
 void swap_clear (int idx){
-	bitmap_set (swap_table, idx, true);
+	if (!swap_table || idx < 0)
+		return;
+	lock_acquire(&swap_lock);
+	bitmap_set (swap_table, idx, SLOT_FREE);
+	lock_release(&swap_lock);
 }
@@ -17,6 +17,7 @@ struct bitmap *swap_table; /* the swap table */
 
 void init_swap_table (void);
 int swap_out (void *frame);
+void swap_out_cluster (void **frames, int *idx, size_t cnt);
 void swap_in (int idx, void *frame);
 void swap_clear (int idx);
 